@@ -12,11 +12,12 @@ if "%GPP_BIN%"=="" (
     echo Found G++ binary.
 )
 set CFLAGS="-std=c++11"
+set THREAD_FLAGS="-pthread"
 
 set BUILD_FLAGS="-O2"
 @REM set BUILD_FLAGS=""
 
-%GPP_BIN% %CFLAGS% %BUILD_FLAGS% -o kdtree.exe src/main.cpp
+%GPP_BIN% %CFLAGS% %THREAD_FLAGS% %BUILD_FLAGS% -o kdtree.exe src/main.cpp
 
 if %ERRORLEVEL%==0 (
     echo:
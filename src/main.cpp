@@ -6,10 +6,28 @@
 #include <thread>
 
 #include "utils/kdtree.h"
+#include "utils/flat_kdtree.h"
+#include "utils/attribute_query.h"
+#include "utils/dual_tree.h"
+#include "utils/polygon.h"
+#include "utils/query_executor.h"
 
 using namespace std;
 
+unsigned poolThreads = defaultThreadCount(); // worker threads of pool(), only read on its first use
 KDTree *tree = nullptr; // main KD-Tree
+KDTreeArena treeArena; // owns the nodes of the main tree
+FlatKDTree flatTree; // read-only copy of the main tree used to answer region queries
+SphereKDTree sphereTree; // the same points as unit vectors, used for nearest-neighbor queries
+bool flatTreeDirty = true; // set whenever the main tree is loaded or changed in bulk
+vector<Data> recentCities; // inserted one by one since the query layouts were last rebuilt, not in them yet
+
+TaskPool &pool();
+
+void syncFlatTree();
+
+template <typename Tree>
+vector<pair<double, Data> > withRecentCities(const Tree &, const Neighbor *, int, double, double, double, size_t);
 
 void progressLoading();
 
@@ -17,6 +35,45 @@ void printOption();
 
 void handleUserInput(bool &);
 
+int runBatch(int, char **);
+
+// the worker threads shared by tree builds and batch queries, started when first needed
+TaskPool &pool() {
+	static TaskPool shared(poolThreads);
+	return shared;
+}
+
+// Rebuild the query layouts if the main tree has been modified since. Cities inserted one at a time wait in
+// recentCities, which every query also scans, until there are more of them than the square root of the
+// layout size: a stream of inserts costs O(sqrt(n) log n) amortized per insert and O(sqrt(n)) per query.
+void syncFlatTree() {
+	if (flatTreeDirty || recentCities.size() * recentCities.size() > (size_t) flatTree.size()) {
+		vector<Data> dataset;
+		NLR_Vectorify(tree, dataset);
+		flatTree = buildFlatKDTree(dataset, &pool());
+		sphereTree = buildSphereKDTree(dataset, &pool());
+		flatTreeDirty = false;
+		recentCities.clear();
+	}
+}
+
+// the cities at the count neighbors found in tree and the recent cities within maxDist km of (latitude,
+// longitude), nearest first, at most k of them
+template <typename Tree>
+vector<pair<double, Data> > withRecentCities(const Tree &tree, const Neighbor *found, int count, double latitude, double longitude, double maxDist, size_t k) {
+	vector<pair<double, Data> > merged;
+	for (int i = 0; i < count; ++i) {
+		merged.push_back({found[i].dist, flatData(tree, found[i].index)});
+	}
+	for (auto &city : recentCities) {
+		double dist = getDist(latitude, longitude, city.latitude, city.longitude);
+		if (dist <= maxDist) merged.push_back({dist, city});
+	}
+	stable_sort(merged.begin(), merged.end(), [](const pair<double, Data> &a, const pair<double, Data> &b) { return a.first < b.first; });
+	if (merged.size() > k) merged.resize(k);
+	return merged;
+}
+
 // COMMAND LINE FUNCTION
 
 void progressLoading() { // just for user interface
@@ -41,6 +98,13 @@ void printOption() {
 	cout << " 8) Save tree to JSON file\n";
 	cout << " 9) Load tree from JSON file\n";
 	cout << "10) Save tree to CSV file\n";
+	cout << "         MORE QUERIES       \n";
+	cout << "11) k-nearest-neighbor search based on giving latitude and longitude.\n";
+	cout << "12) Query cities within a radius (km) of a location, nearest first\n";
+	cout << "13) Approximate k-nearest-neighbor search (epsilon, visit budget)\n";
+	cout << "14) Count cities within a specified rectangular region\n";
+	cout << "15) Query cities inside a polygon read from a CSV file (lat,lng per vertex)\n";
+	cout << "16) Query the most populous cities within a specified rectangular region\n";
 	cout << "Your option: ";
 }
 
@@ -51,11 +115,12 @@ void handleUserInput(bool &userLoop) {
 		progressLoading();
 		cout << "Complete loading dataset\n";
 		if (tree == nullptr) {
-			tree = readCSVFileIntoTree("./worldcities.csv");
+			tree = readCSVFileIntoTree(treeArena, "./worldcities.csv", &pool());
 			if (tree == nullptr) {
 				cout << "Cannot find file worldcities.csv in working directory.\n";
 				return;
 			}
+			flatTreeDirty = true;
 		}
 	} else if (opt == 2) {
 		string city;
@@ -68,7 +133,9 @@ void handleUserInput(bool &userLoop) {
 		cout << "Longitude: ";
 		cin >> longitude;
 		cout << "Insert (" << city << ", " << latitude << ", " << longitude << ") into KD-Tree\n";
-		insertDataBalance(tree, {city, latitude, longitude});
+		Data inserted = {cityNames().intern(city), latitude, longitude, 0, 0, 0}; // unknown country and population
+		insertDataBalance(treeArena, tree, inserted, &pool());
+		recentCities.push_back(inserted);
 	} else if (opt == 3) {
 		string csvPath;
 		cout << "Enter csv file path: ";
@@ -97,7 +164,8 @@ void handleUserInput(bool &userLoop) {
 			} else {
 				progressLoading();
 				cout << "Complete loading csv file\n";
-				insertBalanceFromCSV(tree, csvPath);
+				insertBalanceFromCSV(treeArena, tree, csvPath, &pool());
+				flatTreeDirty = true;
 			}
 		}
 		if (fin.is_open()) fin.close();
@@ -111,10 +179,67 @@ void handleUserInput(bool &userLoop) {
 			cout << "Longitude: ";
 			cin >> longitude;
 			double bestDist = 0;
-			Data bestCity, targ = {"", latitude, longitude};
-
-			nearestNeighborSearch(tree, targ, 0, true, bestDist, bestCity);
-			cout << "Closet city to your location is (" << bestCity.city << ", " << bestCity.latitude << ", " << bestCity.longitude << ") with distance " << bestDist << '\n';
+			syncFlatTree();
+			Data bestCity = flatData(sphereTree, flatNearestNeighbor(sphereTree, latitude, longitude, bestDist));
+			for (auto &city : recentCities) {
+				double dist = getDist(latitude, longitude, city.latitude, city.longitude);
+				if (dist < bestDist) {
+					bestDist = dist;
+					bestCity = city;
+				}
+			}
+			cout << "Closet city to your location is (" << cityNames().name(bestCity.city) << ", " << bestCity.latitude << ", " << bestCity.longitude << ") with distance " << bestDist << '\n';
+		}
+	} else if (opt == 11) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			double latitude, longitude;
+			int k;
+			cout << "Latitude: ";
+			cin >> latitude;
+			cout << "Longitude: ";
+			cin >> longitude;
+			cout << "Number of cities: ";
+			cin >> k;
+			syncFlatTree();
+			vector<Neighbor> nearest(max(k, 0));
+			int found = kNearest(sphereTree, latitude, longitude, k, nearest.data());
+			vector<pair<double, Data> > cities = withRecentCities(sphereTree, nearest.data(), found, latitude, longitude, HUGE_VAL, max(k, 0));
+			for (size_t i = 0; i < cities.size(); ++i) {
+				Data city = cities[i].second;
+				cout << i + 1 << ") (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") with distance " << cities[i].first << '\n';
+			}
+		}
+	} else if (opt == 13) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			double latitude, longitude;
+			int k;
+			SearchOptions options;
+			cout << "Latitude: ";
+			cin >> latitude;
+			cout << "Longitude: ";
+			cin >> longitude;
+			cout << "Number of cities: ";
+			cin >> k;
+			cout << "Epsilon (0 = exact): ";
+			cin >> options.eps;
+			cout << "Visit budget (0 = none): ";
+			cin >> options.visitBudget;
+			syncFlatTree();
+			vector<Neighbor> nearest(max(k, 0));
+			SearchStats exact, approximate;
+			kNearest(sphereTree, latitude, longitude, k, nearest.data(), SearchOptions(), &exact);
+			int found = kNearest(sphereTree, latitude, longitude, k, nearest.data(), options, &approximate);
+			vector<pair<double, Data> > cities = withRecentCities(sphereTree, nearest.data(), found, latitude, longitude, HUGE_VAL, max(k, 0));
+			for (size_t i = 0; i < cities.size(); ++i) {
+				Data city = cities[i].second;
+				cout << i + 1 << ") (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") with distance " << cities[i].first << '\n';
+			}
+			cout << "Examined " << approximate.visited << " of " << sphereTree.size() << " cities (exact search: " << exact.visited
+			     << "), skipped " << approximate.pruned << " subtrees" << (approximate.stopped ? ", stopped by the visit budget" : "") << '\n';
 		}
 	} else if (opt == 5) {
 		if (tree == nullptr) {
@@ -135,14 +260,130 @@ void handleUserInput(bool &userLoop) {
 			string outputFile;
 			getline(cin, outputFile);
 
-			vector<Data> queries = {};
-			rangeQuery(tree, queries, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong, 0);
-			for (auto &query : queries) {
-				cout << "City (" << query.city << ", " << query.latitude << ", " << query.longitude << ") is in range\n";
-			}
+			// hits go straight to the screen and the file, nothing is collected in between
+			syncFlatTree();
+			ofstream csv;
 			if (!outputFile.empty()) {
+				csv.open(outputFile.c_str());
+				writeCSVHeader(csv, flatTree.attributes.extraNames);
+			}
+			visitRange(flatTree, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong, [&csv](long long i) {
+				Data query = flatData(flatTree, i);
+				cout << "City (" << cityNames().name(query.city) << ", " << query.latitude << ", " << query.longitude << ") is in range\n";
+				if (csv.is_open()) writeCSVRow(csv, flatTree, i);
+				return true;
+			});
+			for (auto &city : recentCities) {
+				if (!isInRange(city, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong)) continue;
+				cout << "City (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") is in range\n";
+				// inserted by hand, so no country, population or extra columns
+				if (csv.is_open()) csv << csvField(cityNames().name(city.city)) << "," << city.latitude << "," << city.longitude << ",,0" << string(flatTree.attributes.extraNames.size(), ',') << "\n";
+			}
+			if (csv.is_open()) {
+				csv.close();
 				cout << "Saved output to file (" << outputFile << ")\n";
-				writeCSVFile(queries, outputFile);
+			}
+		}
+	} else if (opt == 16) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			double bottomLeftLat, bottomLeftLong;
+			double topRightLat, topRightLong;
+			int k;
+			cout << "Bottom-left latitude: ";
+			cin >> bottomLeftLat;
+			cout << "Bottom-left longitude: ";
+			cin >> bottomLeftLong;
+			cout << "Top-right latitude: ";
+			cin >> topRightLat;
+			cout << "Top-right longitude: ";
+			cin >> topRightLong;
+			cout << "Number of cities: ";
+			cin >> k;
+			syncFlatTree();
+			vector<long long> largest;
+			topKByPopulation(flatTree, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong, k, largest);
+			vector<Data> cities;
+			for (auto i : largest) {
+				cities.push_back(flatData(flatTree, i));
+			}
+			for (auto &city : recentCities) {
+				if (isInRange(city, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong)) cities.push_back(city);
+			}
+			stable_sort(cities.begin(), cities.end(), [](const Data &a, const Data &b) { return a.population > b.population; });
+			if ((int) cities.size() > k) cities.resize(max(k, 0));
+			for (size_t i = 0; i < cities.size(); ++i) {
+				Data city = cities[i];
+				cout << i + 1 << ") (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") with population " << city.population << '\n';
+			}
+		}
+	} else if (opt == 14) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			double bottomLeftLat, bottomLeftLong;
+			double topRightLat, topRightLong;
+			cout << "Bottom-left latitude: ";
+			cin >> bottomLeftLat;
+			cout << "Bottom-left longitude: ";
+			cin >> bottomLeftLong;
+			cout << "Top-right latitude: ";
+			cin >> topRightLat;
+			cout << "Top-right longitude: ";
+			cin >> topRightLong;
+			syncFlatTree();
+			long long count = rangeCount(flatTree, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong);
+			for (auto &city : recentCities) {
+				if (isInRange(city, bottomLeftLat, bottomLeftLong, topRightLat, topRightLong)) ++count;
+			}
+			cout << count << " cities are in range\n";
+		}
+	} else if (opt == 15) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			string polygonFile;
+			cout << "Polygon csv: ";
+			cin.ignore();
+			getline(cin, polygonFile);
+			GeoPolygon polygon(readNumberCSV(polygonFile, 2));
+			if (polygon.edges() < 3) {
+				cout << "A polygon needs at least 3 vertices\n";
+			} else {
+				syncFlatTree();
+				long long count = 0;
+				visitPolygon(flatTree, polygon, [&count](long long i) {
+					Data city = flatData(flatTree, i);
+					cout << "City (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") is inside\n";
+					++count;
+					return true;
+				});
+				for (auto &city : recentCities) {
+					if (!polygon.contains(city.latitude, city.longitude)) continue;
+					cout << "City (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") is inside\n";
+					++count;
+				}
+				cout << count << " cities are inside the polygon\n";
+			}
+		}
+	} else if (opt == 12) {
+		if (tree == nullptr) {
+			cout << "Tree is empty\n";
+		} else {
+			double latitude, longitude, radius;
+			cout << "Latitude: ";
+			cin >> latitude;
+			cout << "Longitude: ";
+			cin >> longitude;
+			cout << "Radius (km): ";
+			cin >> radius;
+			syncFlatTree();
+			vector<Neighbor> hits = {};
+			radiusQuery(flatTree, latitude, longitude, radius, hits, true);
+			for (auto &hit : withRecentCities(flatTree, hits.data(), (int) hits.size(), latitude, longitude, radius, hits.size() + recentCities.size())) {
+				Data city = hit.second;
+				cout << "City (" << cityNames().name(city.city) << ", " << city.latitude << ", " << city.longitude << ") at distance " << hit.first << '\n';
 			}
 		}
 	} else if (opt == 6) {
@@ -168,12 +409,14 @@ void handleUserInput(bool &userLoop) {
 		cin.ignore();
 		string filePath;
 		getline(cin, filePath);
-		KDTree *nTree = loadKDTree(filePath);
+		KDTreeArena nArena;
+		KDTree *nTree = loadKDTree(nArena, filePath);
 		if (nTree == nullptr) {
 			cout << "Failed to load tree from file " << filePath << "\n";
 		} else {
-			deleteTree(tree);
+			swap(treeArena, nArena); // the old nodes go away with nArena
 			tree = nTree;
+			flatTreeDirty = true;
 			cout << "Succeed to load tree from file " << filePath << "\n";
 		}
 	} else if (opt == 10) {
@@ -191,21 +434,209 @@ void handleUserInput(bool &userLoop) {
 	}
 }
 
+// NON-INTERACTIVE MODE
+
+// kdtree batch <nn|knn|range|count> <cities.csv> <queries.csv> <output.csv> [--k N] [--threads N] [--eps E] [--budget N] [--limit N]
+//                                                                          [--min-population N] [--country NAME]
+// kdtree batch join <cities.csv> <distance km> <output.csv> [--threads N]
+// kdtree batch graph <cities.csv> <k> <output.csv> [--threads N]
+// Query rows are "lat,lng" (nn, knn) or "bottom-left lat,lng,top-right lat,lng" (range, count) after a header line.
+// --eps and --budget make nn and knn approximate (see SearchOptions), --limit caps the hits of each range query.
+// --min-population and --country restrict nn and knn to the cities that match (see AttributeFilter).
+// join writes every pair of cities at most the given distance apart, graph the k nearest other cities of each city.
+int runBatch(int argc, char **argv) {
+	if (argc < 6) {
+		cout << "Usage: kdtree batch <nn|knn|range|count> <cities.csv> <queries.csv> <output.csv> [--k N] [--threads N] [--eps E] [--budget N] [--limit N]\n";
+		cout << "                                                                          [--min-population N] [--country NAME]\n";
+		cout << "       kdtree batch join <cities.csv> <distance km> <output.csv> [--threads N]\n";
+		cout << "       kdtree batch graph <cities.csv> <k> <output.csv> [--threads N]\n";
+		return 1;
+	}
+	string mode = argv[2];
+	int k = 10;
+	unsigned threads = defaultThreadCount();
+	SearchOptions options;
+	long long limit = 0;
+	long long minPopulation = 0;
+	string country;
+	for (int i = 6; i + 1 < argc; i += 2) {
+		string flag = argv[i];
+		if (flag == "--k") {
+			k = max(1, atoi(argv[i + 1]));
+		} else if (flag == "--threads") {
+			threads = (unsigned) max(1, atoi(argv[i + 1]));
+		} else if (flag == "--eps") {
+			options.eps = max(0.0, atof(argv[i + 1]));
+		} else if (flag == "--budget") {
+			options.visitBudget = max(0LL, atoll(argv[i + 1]));
+		} else if (flag == "--limit") {
+			limit = max(0LL, atoll(argv[i + 1]));
+		} else if (flag == "--min-population") {
+			minPopulation = atoll(argv[i + 1]);
+		} else if (flag == "--country") {
+			country = argv[i + 1];
+		}
+	}
+	if (mode != "nn" && mode != "knn" && mode != "range" && mode != "count" && mode != "join" && mode != "graph") {
+		cout << "Unknown batch mode " << mode << "\n";
+		return 1;
+	}
+
+	poolThreads = threads - 1; // the calling thread works too
+	TaskPool &batchPool = pool();
+	vector<Data> dataset = readCSVFile(argv[3]);
+	if (dataset.empty()) {
+		cout << "No cities in " << argv[3] << "\n";
+		return 1;
+	}
+	bool boxes = mode == "range" || mode == "count";
+	vector<double> queries = mode == "join" || mode == "graph" ? vector<double>() : readNumberCSV(argv[4], boxes ? 4 : 2);
+	ofstream out(argv[5]);
+	if (!out.is_open()) {
+		cout << "Cannot open " << argv[5] << "\n";
+		return 1;
+	}
+
+	auto start = chrono::steady_clock::now();
+	long long n;
+	SearchStats stats;
+	if (mode == "join") {
+		SphereKDTree sphere = buildSphereKDTree(dataset, &batchPool);
+		n = 0;
+		out << "city_a,lat_a,lng_a,city_b,lat_b,lng_b,distance\n";
+		selfJoin(sphere, atof(argv[4]), [&](const JoinPair *pairs, size_t count) {
+			for (size_t i = 0; i < count; ++i) {
+				Data a = flatData(sphere, pairs[i].first), b = flatData(sphere, pairs[i].second);
+				out << csvField(cityNames().name(a.city)) << "," << a.latitude << "," << a.longitude << ","
+				    << csvField(cityNames().name(b.city)) << "," << b.latitude << "," << b.longitude << "," << getDist(a, b) << "\n";
+			}
+			n += (long long) count;
+		}, &batchPool);
+	} else if (mode == "graph") {
+		SphereKDTree sphere = buildSphereKDTree(dataset, &batchPool);
+		KnnGraph graph;
+		allKNearest(sphere, max(1, atoi(argv[4])), graph, &batchPool);
+		n = graph.size();
+		out << "city,lat,lng,rank,neighbor,neighbor_lat,neighbor_lng,distance\n";
+		for (long long i = 0; i < n; ++i) {
+			Data city = flatData(sphere, i);
+			for (long long e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e) {
+				Data neighbor = flatData(sphere, graph.neighbors[e]);
+				out << csvField(cityNames().name(city.city)) << "," << city.latitude << "," << city.longitude << "," << e - graph.offsets[i] + 1 << ","
+				    << csvField(cityNames().name(neighbor.city)) << "," << neighbor.latitude << "," << neighbor.longitude << "," << graph.distances[e] << "\n";
+			}
+		}
+	} else if (boxes) {
+		FlatKDTree geo = buildFlatKDTree(dataset, &batchPool);
+		n = (long long) queries.size() / 4;
+		vector<double> lo(2 * n), hi(2 * n);
+		for (long long i = 0; i < n; ++i) {
+			lo[2 * i] = queries[4 * i];
+			lo[2 * i + 1] = queries[4 * i + 1];
+			hi[2 * i] = queries[4 * i + 2];
+			hi[2 * i + 1] = queries[4 * i + 3];
+		}
+		QueryExecutor<double, 2, HaversineMetric> executor(geo, batchPool);
+		if (mode == "count") {
+			vector<long long> counts(n);
+			executor.count(lo.data(), hi.data(), n, counts.data());
+			out << "query,count\n";
+			for (long long i = 0; i < n; ++i) {
+				out << i << "," << counts[i] << "\n";
+			}
+		} else {
+			vector<long long> offsets, hits;
+			executor.range(lo.data(), hi.data(), n, offsets, hits, limit);
+			out << "query,city,lat,lng\n";
+			for (long long i = 0; i < n; ++i) {
+				for (long long h = offsets[i]; h < offsets[i + 1]; ++h) {
+					Data city = flatData(geo, hits[h]);
+					out << i << "," << csvField(cityNames().name(city.city)) << "," << city.latitude << "," << city.longitude << "\n";
+				}
+			}
+		}
+	} else {
+		SphereKDTree sphere = buildSphereKDTree(dataset, &batchPool);
+		n = (long long) queries.size() / 2;
+		vector<double> targets(3 * n);
+		for (long long i = 0; i < n; ++i) {
+			toUnitVector(queries[2 * i], queries[2 * i + 1], &targets[3 * i]);
+		}
+		QueryExecutor<double, 3, ChordMetric> executor(sphere, batchPool);
+		bool filtered = minPopulation > 0 || !country.empty();
+		AttributeFilter filter(sphere.attributes, minPopulation, country.empty() ? -1 : (long long) countryNames().intern(country));
+		if (mode == "nn" && filtered) { // a filtered nearest neighbor is the first of a filtered kNN
+			vector<Neighbor> nearest(n);
+			vector<int> found(n);
+			executor.kNearest(targets.data(), n, 1, nearest.data(), found.data(), options, &stats, filter);
+			out << "query,city,country,lat,lng,distance\n";
+			for (long long i = 0; i < n; ++i) {
+				if (found[i] == 0) continue;
+				Data city = flatData(sphere, nearest[i].index);
+				out << i << "," << csvField(cityNames().name(city.city)) << "," << csvField(countryNames().name(city.country)) << "," << city.latitude << "," << city.longitude << "," << nearest[i].dist << "\n";
+			}
+		} else if (mode == "nn") {
+			vector<long long> index(n);
+			vector<double> dist(n);
+			executor.nearest(targets.data(), n, index.data(), dist.data(), options, &stats);
+			out << "query,city,country,lat,lng,distance\n";
+			for (long long i = 0; i < n; ++i) {
+				Data city = flatData(sphere, index[i]);
+				out << i << "," << csvField(cityNames().name(city.city)) << "," << csvField(countryNames().name(city.country)) << "," << city.latitude << "," << city.longitude << "," << dist[i] << "\n";
+			}
+		} else {
+			vector<Neighbor> nearest(n * k);
+			vector<int> found(n);
+			if (filtered) {
+				executor.kNearest(targets.data(), n, k, nearest.data(), found.data(), options, &stats, filter);
+			} else {
+				executor.kNearest(targets.data(), n, k, nearest.data(), found.data(), options, &stats);
+			}
+			out << "query,rank,city,country,lat,lng,distance\n";
+			for (long long i = 0; i < n; ++i) {
+				for (int j = 0; j < found[i]; ++j) {
+					Neighbor &hit = nearest[i * k + j];
+					Data city = flatData(sphere, hit.index);
+					out << i << "," << j + 1 << "," << csvField(cityNames().name(city.city)) << "," << csvField(countryNames().name(city.country)) << "," << city.latitude << "," << city.longitude << "," << hit.dist << "\n";
+				}
+			}
+		}
+	}
+	out.close();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (mode == "join") {
+		cout << "Found " << n << " pairs within " << argv[4] << " km with " << threads << " threads in " << seconds << "s\n";
+	} else if (mode == "graph") {
+		cout << "Built the " << argv[4] << "-nearest-neighbor graph of " << n << " cities with " << threads << " threads in " << seconds << "s\n";
+	} else {
+		cout << "Answered " << n << " " << mode << " queries with " << threads << " threads in " << seconds << "s\n";
+	}
+	if (stats.queries > 0) {
+		cout << "Examined " << (double) stats.visited / stats.queries << " of " << dataset.size() << " cities per query, skipped "
+		     << stats.pruned << " subtrees, " << stats.stopped << " queries stopped by the visit budget\n";
+	}
+	return 0;
+}
+
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
-int main() {
+int main(int argc, char **argv) {
 	#ifdef _WIN32
 	SetConsoleOutputCP(65001);
 	#endif
 
+	if (argc > 1 && string(argv[1]) == "batch") {
+		return runBatch(argc, argv);
+	}
+
 	bool userLoop = true;
 	while (userLoop) {
 		printOption();
 		handleUserInput(userLoop);
 	}
 
-	deleteTree(tree); // granted to free out the tree
+	deleteTree(treeArena, tree); // granted to free out the tree
 	return 0;
 }
\ No newline at end of file
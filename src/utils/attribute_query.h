@@ -0,0 +1,140 @@
+#ifndef KD_TREE_ATTRIBUTE_QUERY_H
+#define KD_TREE_ATTRIBUTE_QUERY_H
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "flat_kdtree.h"
+
+using namespace std;
+
+// Filter for kNearest() and friends on the attributes of a tree built from a dataset: keeps the points with
+// at least minPopulation people and, unless country is -1, in that country (an id in countryNames()). A
+// subtree is skipped when its largest population is too small or its country set lacks the country's bit.
+struct AttributeFilter {
+	const AttributeTable *table;
+	long long minPopulation;
+	long long country;
+
+	explicit AttributeFilter(const AttributeTable &table, long long minPopulation = 0, long long country = -1)
+		: table(&table), minPopulation(minPopulation), country(country) {}
+
+	bool subtree(long long m) const {
+		return table->subtreeMaxPopulation[m] >= minPopulation &&
+		       (country < 0 || (table->subtreeCountries[m] & countryBit((uint32_t) country)) != 0);
+	}
+
+	bool point(long long i) const {
+		return table->population[i] >= minPopulation && (country < 0 || table->country[i] == country);
+	}
+};
+
+// the nearest point the filter passes (-1 if there is none), bestDist gets its reported distance
+template <typename Coord, int Dim, typename Metric>
+long long filteredNearestNeighbor(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, const AttributeFilter &filter, double &bestDist,
+                                  const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	Neighbor best;
+	if (kNearest(tree, q, 1, &best, options, stats, filter) == 0) {
+		bestDist = 0;
+		return -1;
+	}
+	bestDist = best.dist;
+	return best.index;
+}
+
+long long filteredNearestNeighbor(const SphereKDTree &tree, double lat, double lng, const AttributeFilter &filter, double &bestDist,
+                                  const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	double q[3];
+	toUnitVector(lat, lng, q);
+	return filteredNearestNeighbor(tree, q, filter, bestDist, options, stats);
+}
+
+// Append to result the indices of the (up to) k most populous points inside the box [lo, hi], largest first.
+// The search is best-first: subtrees and single points wait in a max-heap keyed by the largest population
+// they can hold (a subtree's maximum, a point's own population), so a point comes off the heap only once
+// nothing left can beat it and the walk ends with the k-th one. The k largest populations queued so far
+// are tracked as well, and nothing that cannot beat the smallest of them is queued at all. Subtrees are
+// tested against the box when they are queued; those entirely inside skip the tests of their descendants.
+template <typename Coord, int Dim, typename Metric>
+void topKByPopulation(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *lo, const Coord *hi, int k, vector<long long> &result) {
+	struct Candidate {
+		long long population; // at least that of every point it covers
+		long long l, r; // a subtree, or l == r with point set
+		bool point, inside;
+
+		bool operator<(const Candidate &other) const { return population < other.population; }
+	};
+	const AttributeTable &table = tree.attributes;
+	if (tree.empty() || table.empty() || k <= 0) return;
+	vector<Candidate> heap;
+	vector<long long> queued; // min-heap of the k largest populations of the points queued so far
+	auto beaten = [&](long long population) {
+		return (int) queued.size() == k && population <= queued.front();
+	};
+	auto queuePoint = [&](long long i) {
+		long long population = table.population[i];
+		if (beaten(population)) return;
+		heap.push_back({population, i, i, true, true});
+		push_heap(heap.begin(), heap.end());
+		if ((int) queued.size() == k) {
+			pop_heap(queued.begin(), queued.end(), greater<long long>());
+			queued.pop_back();
+		}
+		queued.push_back(population);
+		push_heap(queued.begin(), queued.end(), greater<long long>());
+	};
+	auto queueSubtree = [&](long long l, long long r, bool inside) {
+		long long m = (l + r) / 2;
+		if (beaten(table.subtreeMaxPopulation[m])) return;
+		if (!inside) {
+			bool disjoint = false;
+			inside = true;
+			for (int d = 0; d < Dim; ++d) {
+				disjoint |= tree.boxHi[d][m] < lo[d] || tree.boxLo[d][m] > hi[d];
+				inside &= tree.boxLo[d][m] >= lo[d] && tree.boxHi[d][m] <= hi[d];
+			}
+			if (disjoint) return;
+		}
+		heap.push_back({table.subtreeMaxPopulation[m], l, r, false, inside});
+		push_heap(heap.begin(), heap.end());
+	};
+	queueSubtree(0, tree.size() - 1, false);
+	int found = 0;
+	while (!heap.empty() && found < k) {
+		pop_heap(heap.begin(), heap.end());
+		Candidate next = heap.back();
+		heap.pop_back();
+		if (next.point) {
+			result.push_back(next.l);
+			++found;
+			continue;
+		}
+		if (next.r - next.l + 1 <= tree.leafSize) { // leaf bucket: its points are queued one by one
+			unsigned char in[LEAF_SCAN_BLOCK];
+			for (long long from = next.l; from <= next.r; from += LEAF_SCAN_BLOCK) {
+				int n = (int) min<long long>(LEAF_SCAN_BLOCK, next.r - from + 1);
+				if (!next.inside) leafInBox(tree, lo, hi, from, n, in);
+				for (int i = 0; i < n; ++i) {
+					if (next.inside || in[i]) queuePoint(from + i);
+				}
+			}
+			continue;
+		}
+		long long m = (next.l + next.r) / 2;
+		bool pointInside = true;
+		for (int d = 0; d < Dim && !next.inside; ++d) {
+			pointInside &= tree.coord[d][m] >= lo[d] && tree.coord[d][m] <= hi[d];
+		}
+		if (pointInside) queuePoint(m);
+		if (m > next.l) queueSubtree(next.l, m - 1, next.inside);
+		if (m < next.r) queueSubtree(m + 1, next.r, next.inside);
+	}
+}
+
+void topKByPopulation(const FlatKDTree &tree, double leftLat, double leftLong, double rightLat, double rightLong, int k, vector<long long> &result) {
+	double lo[2] = {leftLat, leftLong}, hi[2] = {rightLat, rightLong};
+	topKByPopulation(tree, lo, hi, k, result);
+}
+
+#endif //KD_TREE_ATTRIBUTE_QUERY_H
@@ -0,0 +1,125 @@
+#ifndef KD_TREE_ATTRIBUTES_H
+#define KD_TREE_ATTRIBUTES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "name_pool.h"
+
+using namespace std;
+
+// a pool whose id 0 is the empty string, so zeroed attributes read as unknown
+NamePool poolWithEmptyName() {
+	NamePool pool;
+	pool.intern("");
+	return pool;
+}
+
+// the pool every country name is interned into, 0 is an unknown country
+NamePool &countryNames() {
+	static NamePool pool = poolWithEmptyName();
+	return pool;
+}
+
+// the pool the values of the extra columns are interned into, 0 is an empty value
+NamePool &attributeValues() {
+	static NamePool pool = poolWithEmptyName();
+	return pool;
+}
+
+// The CSV columns past the known ones (city, lat, lng, country, population) of every city read so far. A
+// city refers to its row by id; only the non-empty cells are kept and row 0 has none, so datasets without
+// extra columns cost nothing here.
+struct ExtraRows {
+	vector<string> names; // every extra column seen, in order of appearance
+	vector<uint32_t> start = {0, 0}; // the cells of row r are cells[start[r], start[r + 1])
+	vector<pair<uint32_t, uint32_t> > cells; // (column, value id in attributeValues())
+
+	// index of the column, added if it is new
+	uint32_t column(const string &name) {
+		for (size_t c = 0; c < names.size(); ++c) {
+			if (names[c] == name) return (uint32_t) c;
+		}
+		names.push_back(name);
+		return (uint32_t) names.size() - 1;
+	}
+
+	// store a row, the empty row is always 0
+	uint32_t add(const vector<pair<uint32_t, uint32_t> > &row) {
+		if (row.empty()) return 0;
+		cells.insert(cells.end(), row.begin(), row.end());
+		start.push_back((uint32_t) cells.size());
+		return (uint32_t) start.size() - 2;
+	}
+
+	// value id of the column in the row, 0 if the row has none
+	uint32_t value(uint32_t row, uint32_t column) const {
+		for (uint32_t k = start[row]; k < start[row + 1]; ++k) {
+			if (cells[k].first == column) return cells[k].second;
+		}
+		return 0;
+	}
+};
+
+ExtraRows &extraRows() {
+	static ExtraRows rows;
+	return rows;
+}
+
+// the bit standing for a country in a 64-bit country set; countries 64 apart share a bit
+uint64_t countryBit(uint32_t country) {
+	return 1ULL << (country & 63);
+}
+
+// Attributes of the points of a flat tree in columns, entry i belonging to the point at index i, so a query
+// reads them at the index it already has instead of going back to the source file. Strings are dictionary
+// encoded: the columns hold ids into a NamePool.
+struct AttributeTable {
+	vector<uint32_t> country; // id in countryNames()
+	vector<long long> population; // 0 when unknown
+	vector<string> extraNames; // the extra columns any of the points has
+	vector<vector<uint32_t> > extra; // extra[c][i] is the value of column extraNames[c], an id in attributeValues()
+
+	// Summaries of every subtree, stored at its middle index like the subtree boxes of the tree, so searches
+	// can skip subtrees none of whose points can match
+	vector<long long> subtreeMaxPopulation;
+	vector<uint64_t> subtreeCountries; // bit countryBit(c) is set when a point of the subtree is in country c
+
+	long long size() const { return (long long) country.size(); }
+	bool empty() const { return country.empty(); }
+
+	// index of the extra column, -1 if there is none
+	int extraColumn(const string &name) const {
+		for (size_t c = 0; c < extraNames.size(); ++c) {
+			if (extraNames[c] == name) return (int) c;
+		}
+		return -1;
+	}
+
+	string extraValue(int column, long long i) const {
+		return attributeValues().name(extra[column][i]);
+	}
+
+	// the table with entry i taken from entry order[i]
+	AttributeTable reordered(const vector<long long> &order) const {
+		AttributeTable table;
+		table.extraNames = extraNames;
+		table.extra.resize(extra.size());
+		table.country.resize(order.size());
+		table.population.resize(order.size());
+		for (size_t c = 0; c < extra.size(); ++c) {
+			table.extra[c].resize(order.size());
+		}
+		for (size_t i = 0; i < order.size(); ++i) {
+			table.country[i] = country[order[i]];
+			table.population[i] = population[order[i]];
+			for (size_t c = 0; c < extra.size(); ++c) {
+				table.extra[c][i] = extra[c][order[i]];
+			}
+		}
+		return table;
+	}
+};
+
+#endif //KD_TREE_ATTRIBUTES_H
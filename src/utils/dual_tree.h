@@ -0,0 +1,467 @@
+#ifndef KD_TREE_DUAL_TREE_H
+#define KD_TREE_DUAL_TREE_H
+
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "flat_kdtree.h"
+#include "small_stack.h"
+#include "task_pool.h"
+
+using namespace std;
+
+// Dual-tree algorithms: instead of one query per point, they walk pairs of subtrees of the same tree and
+// decide a whole pair at once from the two bounding boxes. They need a metric with boxPairBound() and
+// boxPairSpan(), such as the Euclidean ones and ChordMetric (so SphereKDTree for points on the globe).
+
+const size_t JOIN_CHUNK = 4096; // result pairs are handed to the sink this many at a time
+const long long JOIN_GRAIN = 4096; // node pairs with fewer points than this are not split into more tasks
+
+// two tree indices, first < second
+typedef pair<long long, long long> JoinPair;
+
+// A pending piece of a self-join. SELF is every pair inside the subtree [al, ar]; CROSS every pair between
+// the disjoint subtrees [al, ar] and [bl, br]; POINT every pair of the single point al (ar == al) with the
+// subtree [bl, br].
+struct JoinTask {
+	enum Kind { SELF, CROSS, POINT };
+	Kind kind;
+	long long al, ar, bl, br;
+
+	long long points() const { return ar - al + 1 + (kind == SELF ? 0 : br - bl + 1); }
+};
+
+// the bounding box of the subtree [l, r]
+template <typename Coord, int Dim, typename Metric>
+void subtreeBox(const BasicFlatKDTree<Coord, Dim, Metric> &tree, long long l, long long r, Coord *lo, Coord *hi) {
+	long long m = (l + r) / 2;
+	for (int d = 0; d < Dim; ++d) {
+		lo[d] = tree.boxLo[d][m];
+		hi[d] = tree.boxHi[d][m];
+	}
+}
+
+// Walk one join task and its descendants. Pairs within limit (compared units) go to pairs, which is handed
+// to flush() whenever it holds JOIN_CHUNK of them; descendants with more than grain points go to spawn()
+// instead of being walked here.
+template <typename Coord, int Dim, typename Metric, typename Flush, typename Spawn>
+void selfJoinWalk(const BasicFlatKDTree<Coord, Dim, Metric> &tree, double limit, const JoinTask &root, long long grain,
+                  vector<JoinPair> &pairs, Flush &flush, Spawn &spawn) {
+	auto emit = [&](long long a, long long b) {
+		pairs.push_back(a < b ? JoinPair(a, b) : JoinPair(b, a));
+		if (pairs.size() >= JOIN_CHUNK) flush(pairs);
+	};
+	SmallStack<JoinTask, 2 * FLAT_STACK_DEPTH> stack;
+	auto push = [&](JoinTask task) {
+		if (task.ar < task.al || (task.kind != JoinTask::SELF && task.br < task.bl)) return;
+		if (task.points() > grain) {
+			spawn(task);
+		} else {
+			stack.push(task);
+		}
+	};
+	double dist[LEAF_SCAN_BLOCK];
+	stack.push(root);
+	while (!stack.empty()) {
+		JoinTask task = stack.pop();
+		long long am = (task.al + task.ar) / 2, bm = (task.bl + task.br) / 2;
+		bool aLeaf = task.ar - task.al + 1 <= tree.leafSize, bLeaf = task.br - task.bl + 1 <= tree.leafSize;
+		Coord aLo[Dim], aHi[Dim], bLo[Dim], bHi[Dim], p[Dim];
+		if (task.kind == JoinTask::SELF) {
+			subtreeBox(tree, task.al, task.ar, aLo, aHi);
+			if (Metric::boxPairSpan(aLo, aHi, aLo, aHi) <= limit) { // every pair is close enough
+				for (long long a = task.al; a <= task.ar; ++a) {
+					for (long long b = a + 1; b <= task.ar; ++b) emit(a, b);
+				}
+			} else if (aLeaf) {
+				for (long long a = task.al; a < task.ar; ++a) {
+					tree.point(a, p);
+					auto query = Metric::query(p);
+					for (long long from = a + 1; from <= task.ar; from += LEAF_SCAN_BLOCK) {
+						int n = (int) min<long long>(LEAF_SCAN_BLOCK, task.ar - from + 1);
+						leafDistances(tree, query, from, n, dist);
+						for (int i = 0; i < n; ++i) {
+							if (dist[i] <= limit) emit(a, from + i);
+						}
+					}
+				}
+			} else {
+				push({JoinTask::POINT, am, am, task.al, am - 1});
+				push({JoinTask::POINT, am, am, am + 1, task.ar});
+				push({JoinTask::CROSS, task.al, am - 1, am + 1, task.ar});
+				push({JoinTask::SELF, am + 1, task.ar, 0, -1});
+				push({JoinTask::SELF, task.al, am - 1, 0, -1});
+			}
+			continue;
+		}
+
+		subtreeBox(tree, task.bl, task.br, bLo, bHi);
+		if (task.kind == JoinTask::POINT) {
+			tree.point(task.al, aLo);
+			tree.point(task.al, aHi);
+			aLeaf = true;
+		} else {
+			subtreeBox(tree, task.al, task.ar, aLo, aHi);
+		}
+		if (Metric::boxPairBound(aLo, aHi, bLo, bHi) > limit) continue; // no pair is close enough
+		if (Metric::boxPairSpan(aLo, aHi, bLo, bHi) <= limit) { // every pair is
+			for (long long a = task.al; a <= task.ar; ++a) {
+				for (long long b = task.bl; b <= task.br; ++b) emit(a, b);
+			}
+			continue;
+		}
+		if (aLeaf && bLeaf) { // every point of a against the block b
+			for (long long a = task.al; a <= task.ar; ++a) {
+				tree.point(a, p);
+				auto query = Metric::query(p);
+				for (long long from = task.bl; from <= task.br; from += LEAF_SCAN_BLOCK) {
+					int n = (int) min<long long>(LEAF_SCAN_BLOCK, task.br - from + 1);
+					leafDistances(tree, query, from, n, dist);
+					for (int i = 0; i < n; ++i) {
+						if (dist[i] <= limit) emit(a, from + i);
+					}
+				}
+			}
+			continue;
+		}
+		// split the larger side, or the one that still can be
+		if (bLeaf || (!aLeaf && task.ar - task.al > task.br - task.bl)) {
+			push({JoinTask::POINT, am, am, task.bl, task.br});
+			push({JoinTask::CROSS, am + 1, task.ar, task.bl, task.br});
+			push({JoinTask::CROSS, task.al, am - 1, task.bl, task.br});
+		} else { // a POINT task is only ever split on this side
+			if (task.kind == JoinTask::POINT) {
+				tree.point(task.al, p);
+				if (Metric::distanceTo(tree, Metric::query(p), bm) <= limit) emit(task.al, bm);
+			} else {
+				push({JoinTask::POINT, bm, bm, task.al, task.ar});
+			}
+			push({task.kind, task.al, task.ar, bm + 1, task.br});
+			push({task.kind, task.al, task.ar, task.bl, bm - 1});
+		}
+	}
+}
+
+// Every pair of points of the tree at most radius apart (reported units, km for SphereKDTree), each
+// unordered pair once, as tree indices. The walk starts from the whole tree paired with itself and splits
+// node pairs until their boxes show that none or all of their pairs qualify; only pairs of leaf buckets
+// that are neither get their distances computed. sink(const JoinPair *pairs, size_t n) receives the result
+// in chunks of up to JOIN_CHUNK pairs, in no particular order and never from two threads at once. With a
+// pool, node pairs that are still large become tasks of their own, so the top levels of the walk are
+// spread over the workers.
+template <typename Coord, int Dim, typename Metric, typename Sink>
+void selfJoin(const BasicFlatKDTree<Coord, Dim, Metric> &tree, double radius, Sink sink, TaskPool *pool = nullptr) {
+	if (tree.size() < 2) return;
+	double limit = Metric::compared(radius);
+	long long grain = pool == nullptr ? numeric_limits<long long>::max()
+	                                  : max(JOIN_GRAIN, tree.size() / (8 * ((long long) pool->size() + 1)));
+	mutex sinkLock;
+	auto flush = [&sink, &sinkLock](vector<JoinPair> &pairs) {
+		if (pairs.empty()) return;
+		lock_guard<mutex> lock(sinkLock);
+		sink(pairs.data(), pairs.size());
+		pairs.clear();
+	};
+	TaskGroup group;
+	function<void(const JoinTask &)> spawn;
+	auto run = [&](const JoinTask &task) {
+		vector<JoinPair> pairs;
+		pairs.reserve(JOIN_CHUNK);
+		selfJoinWalk(tree, limit, task, grain, pairs, flush, spawn);
+		flush(pairs);
+	};
+	spawn = [&](const JoinTask &task) {
+		pool->submit(group, [&run, task]() { run(task); });
+	};
+	run({JoinTask::SELF, 0, tree.size() - 1, 0, -1});
+	if (pool != nullptr) pool->wait(group);
+}
+
+// collect the pairs of selfJoin() into result
+template <typename Coord, int Dim, typename Metric>
+void selfJoinPairs(const BasicFlatKDTree<Coord, Dim, Metric> &tree, double radius, vector<JoinPair> &result, TaskPool *pool = nullptr) {
+	selfJoin(tree, radius, [&result](const JoinPair *pairs, size_t n) {
+		result.insert(result.end(), pairs, pairs + n);
+	}, pool);
+}
+
+// k nearest neighbors of every point of a query tree among the points of a reference tree, in compressed
+// sparse row form: the neighbors of query point i (tree order) are neighbors[offsets[i] .. offsets[i + 1]),
+// nearest first, as reference tree indices, with their distances in reported units alongside
+struct KnnGraph {
+	vector<long long> offsets;
+	vector<long long> neighbors;
+	vector<double> distances;
+
+	long long size() const { return offsets.empty() ? 0 : (long long) offsets.size() - 1; }
+};
+
+// One side of a pending all-kNN node pair: the subtree [l, r], or the single point l when point is set,
+// which is a leaf whose box is the point itself
+struct KnnNode {
+	long long l, r;
+	bool point;
+};
+
+// the box of a node, and whether it is a leaf
+template <typename Coord, int Dim, typename Metric>
+bool knnNodeBox(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const KnnNode &node, Coord *lo, Coord *hi) {
+	if (node.point) {
+		tree.point(node.l, lo);
+		tree.point(node.l, hi);
+		return true;
+	}
+	subtreeBox(tree, node.l, node.r, lo, hi);
+	return node.r - node.l + 1 <= tree.leafSize;
+}
+
+// Walk the points of the subtree [rootL, rootR] as queries against the whole tree as reference points.
+// heaps[q * k ..] and counts[q] are the candidate max-heaps of the query points (see offerNeighbor);
+// bounds[m] and lowBounds[m] are the largest and the smallest k-th candidate distance over the points of
+// the query subtree whose middle index is m. A reference node is skipped for a query node once their boxes
+// are at least the largest of these apart, or further than the smallest plus the query box's diameter,
+// which by the triangle inequality already leaves every query point k closer candidates (the metric's
+// compared values are squared lengths, so their roots are added). Either way the reference node is pruned
+// for all of the query node's points at once. Bounds only ever shrink, so one computed from children that
+// have improved since is merely less tight. Pairs of inner nodes are split on both sides, each query child
+// taking the nearer reference child first, down to pairs of leaves. The split point of a reference node
+// goes straight to the points of a query leaf; the split points of the query side are not walked here at
+// all, allKNearest() searches them on their own.
+template <typename Coord, int Dim, typename Metric>
+void allKNearestWalk(const BasicFlatKDTree<Coord, Dim, Metric> &tree, int k, long long rootL, long long rootR,
+                     Neighbor *heaps, int *counts, double *bounds, double *lowBounds) {
+	struct Pair {
+		KnnNode query, ref;
+	};
+	const double unbounded = numeric_limits<double>::infinity();
+	auto kth = [&](long long q) { return counts[q] < k ? unbounded : heaps[q * k].dist; };
+	SmallStack<Pair, 4 * FLAT_STACK_DEPTH> stack;
+	double dist[LEAF_SCAN_BLOCK];
+	stack.push({{rootL, rootR, false}, {0, tree.size() - 1, false}});
+	while (!stack.empty()) {
+		Pair task = stack.pop();
+		const KnnNode &query = task.query, &ref = task.ref;
+		if (query.r < query.l || ref.r < ref.l) continue;
+		Coord qLo[Dim], qHi[Dim], rLo[Dim], rHi[Dim];
+		bool queryLeaf = knnNodeBox(tree, query, qLo, qHi), refLeaf = knnNodeBox(tree, ref, rLo, rHi);
+		long long qm = (query.l + query.r) / 2, rm = (ref.l + ref.r) / 2;
+		double bound = bounds[qm], low = lowBounds[qm];
+		if (!queryLeaf) { // refresh from the children, which may have improved since
+			bound = 0;
+			low = unbounded;
+			if (qm > query.l) {
+				bound = max(bound, bounds[(query.l + qm - 1) / 2]);
+				low = min(low, lowBounds[(query.l + qm - 1) / 2]);
+			}
+			if (qm < query.r) {
+				bound = max(bound, bounds[(qm + 1 + query.r) / 2]);
+				low = min(low, lowBounds[(qm + 1 + query.r) / 2]);
+			}
+			bounds[qm] = bound;
+			lowBounds[qm] = low;
+		}
+		double gap = Metric::boxPairBound(qLo, qHi, rLo, rHi);
+		if (gap >= bound) continue;
+		if (low < unbounded) {
+			double reach = sqrt(low) + sqrt(Metric::boxPairSpan(qLo, qHi, qLo, qHi));
+			if (gap > reach * reach) continue;
+		}
+
+		if (queryLeaf && refLeaf) { // every query point against the reference block
+			double leafBound = 0, leafLow = unbounded;
+			for (long long q = query.l; q <= query.r; ++q) {
+				Coord p[Dim];
+				tree.point(q, p);
+				if (Metric::boxBound(p, rLo, rHi) < kth(q)) { // otherwise the block cannot improve this point
+					auto target = Metric::query(p);
+					for (long long from = ref.l; from <= ref.r; from += LEAF_SCAN_BLOCK) {
+						int n = (int) min<long long>(LEAF_SCAN_BLOCK, ref.r - from + 1);
+						leafDistances(tree, target, from, n, dist);
+						for (int i = 0; i < n; ++i) {
+							offerNeighbor(heaps + q * k, counts[q], k, dist[i], from + i);
+						}
+					}
+				}
+				leafBound = max(leafBound, kth(q));
+				leafLow = min(leafLow, kth(q));
+			}
+			bounds[qm] = leafBound;
+			lowBounds[qm] = leafLow;
+			continue;
+		}
+		KnnNode queryParts[2] = {{query.l, qm - 1, false}, {qm + 1, query.r, false}};
+		int parts = 2;
+		if (queryLeaf) {
+			queryParts[0] = query;
+			parts = 1;
+		}
+		if (refLeaf) {
+			for (int i = 0; i < parts; ++i) stack.push({queryParts[i], ref});
+			continue;
+		}
+		Coord p[Dim];
+		tree.point(rm, p);
+		if (!queryLeaf) {
+			stack.push({query, {rm, rm, true}});
+		} else if (Metric::boxBound(p, qLo, qHi) < bound) {
+			auto target = Metric::query(p);
+			for (long long q = query.l; q <= query.r; ++q) {
+				offerNeighbor(heaps + q * k, counts[q], k, Metric::distanceTo(tree, target, q), rm);
+			}
+		}
+		// the farther reference child is pushed first, so that the nearer one can tighten the bounds first
+		KnnNode refParts[2] = {{ref.l, rm - 1, false}, {rm + 1, ref.r, false}};
+		for (int i = 0; i < parts; ++i) {
+			if (queryParts[i].r < queryParts[i].l) continue;
+			Coord lo[Dim], hi[Dim], childLo[Dim], childHi[Dim];
+			knnNodeBox(tree, queryParts[i], lo, hi);
+			double childGap[2];
+			for (int j = 0; j < 2; ++j) {
+				childGap[j] = numeric_limits<double>::max();
+				if (refParts[j].l > refParts[j].r) continue;
+				subtreeBox(tree, refParts[j].l, refParts[j].r, childLo, childHi);
+				childGap[j] = Metric::boxPairBound(lo, hi, childLo, childHi);
+			}
+			int nearer = childGap[0] <= childGap[1] ? 0 : 1;
+			stack.push({queryParts[i], refParts[1 - nearer]});
+			stack.push({queryParts[i], refParts[nearer]});
+		}
+	}
+}
+
+// Sort the candidate heaps (width per point) into graph, reporting distances. With skipSelf each point drops
+// itself, or the last candidate when as many others are just as close, keeping at most k.
+template <typename Metric>
+void knnGraphFromHeaps(vector<Neighbor> &heaps, vector<int> &counts, int width, int k, bool skipSelf, KnnGraph &graph) {
+	long long n = (long long) counts.size();
+	graph.offsets.assign(n + 1, 0);
+	for (long long q = 0; q < n; ++q) {
+		Neighbor *heap = heaps.data() + q * width;
+		sort_heap(heap, heap + counts[q]);
+		if (skipSelf) {
+			int kept = 0;
+			for (int i = 0; i < counts[q] && kept < k; ++i) {
+				if (heap[i].index != q) heap[kept++] = heap[i];
+			}
+			counts[q] = kept;
+		}
+		graph.offsets[q + 1] = graph.offsets[q] + counts[q];
+	}
+	graph.neighbors.resize(graph.offsets[n]);
+	graph.distances.resize(graph.offsets[n]);
+	for (long long q = 0; q < n; ++q) {
+		const Neighbor *heap = heaps.data() + q * width;
+		for (int i = 0; i < counts[q]; ++i) {
+			graph.neighbors[graph.offsets[q] + i] = heap[i].index;
+			graph.distances[graph.offsets[q] + i] = Metric::report(heap[i].dist);
+		}
+	}
+}
+
+// The kNN graph of a tree: the k nearest other points of each of its points. The tree is cut into subtrees
+// of at most grain points that are walked against the whole tree with allKNearestWalk(), and the split
+// points of the subtrees that are not leaves are searched one by one. With a pool every such subtree and
+// every block of split points is a task of its own; a point belongs to exactly one task, so the tasks
+// write to disjoint parts of the heaps and bounds. Every point keeps k + 1 candidates, itself included.
+template <typename Coord, int Dim, typename Metric>
+void allKNearest(const BasicFlatKDTree<Coord, Dim, Metric> &tree, int k, KnnGraph &graph, TaskPool *pool = nullptr) {
+	struct Range {
+		long long l, r;
+		bool part; // inside a subtree that is walked as a whole
+	};
+	long long n = tree.size();
+	graph = KnnGraph();
+	graph.offsets.assign(n + 1, 0);
+	if (n == 0 || k <= 0) return;
+	int width = k + 1;
+	vector<Neighbor> heaps(n * width);
+	vector<int> counts(n, 0);
+	vector<double> bounds(n, numeric_limits<double>::infinity()), lowBounds(bounds);
+
+	long long grain = pool == nullptr ? n : max(JOIN_GRAIN, n / (8 * ((long long) pool->size() + 1)));
+	grain = max(grain, tree.leafSize);
+	vector<pair<long long, long long> > parts;
+	vector<long long> splitPoints;
+	SmallStack<Range, FLAT_STACK_DEPTH> pending;
+	pending.push({0, n - 1, false});
+	while (!pending.empty()) {
+		Range range = pending.pop();
+		long long size = range.r - range.l + 1, m = (range.l + range.r) / 2;
+		if (size <= 0) continue;
+		if (!range.part && size <= grain) {
+			parts.push_back({range.l, range.r});
+			range.part = true;
+		}
+		if (size <= tree.leafSize) continue;
+		splitPoints.push_back(m);
+		pending.push({range.l, m - 1, range.part});
+		pending.push({m + 1, range.r, range.part});
+	}
+
+	auto walkPart = [&](size_t i) {
+		allKNearestWalk(tree, width, parts[i].first, parts[i].second, heaps.data(), counts.data(), bounds.data(), lowBounds.data());
+	};
+	auto searchPoints = [&](size_t from, size_t to) {
+		SearchStats stats;
+		for (size_t i = from; i < to; ++i) {
+			long long q = splitPoints[i];
+			Coord p[Dim];
+			tree.point(q, p);
+			flatKNearestSearch(tree, p, width, 0, n - 1, 0, heaps.data() + q * width, counts[q], SearchOptions(), stats);
+		}
+	};
+	if (pool == nullptr) {
+		for (size_t i = 0; i < parts.size(); ++i) walkPart(i);
+		searchPoints(0, splitPoints.size());
+	} else {
+		TaskGroup group;
+		for (size_t i = 0; i < parts.size(); ++i) {
+			pool->submit(group, [&walkPart, i]() { walkPart(i); });
+		}
+		for (size_t from = 0; from < splitPoints.size(); from += (size_t) JOIN_GRAIN) {
+			size_t to = min(splitPoints.size(), from + (size_t) JOIN_GRAIN);
+			pool->submit(group, [&searchPoints, from, to]() { searchPoints(from, to); });
+		}
+		pool->wait(group);
+	}
+	knnGraphFromHeaps<Metric>(heaps, counts, width, k, true, graph);
+}
+
+// The k nearest reference points of every point of a separate query tree (same metric). The nodes of two
+// unrelated trees do not line up, and on these low-dimensional trees pairs of them prune too little to pay
+// for the walk, so each query point gets a single-tree search instead; going through the points in query
+// tree order keeps consecutive searches on the same reference nodes. With a pool, blocks of JOIN_GRAIN
+// query points are tasks of their own.
+template <typename Coord, int Dim, typename Metric>
+void allKNearest(const BasicFlatKDTree<Coord, Dim, Metric> &queries, const BasicFlatKDTree<Coord, Dim, Metric> &reference, int k,
+                 KnnGraph &graph, TaskPool *pool = nullptr) {
+	long long n = queries.size();
+	graph = KnnGraph();
+	graph.offsets.assign(n + 1, 0);
+	if (n == 0 || reference.empty() || k <= 0) return;
+	vector<Neighbor> heaps(n * k);
+	vector<int> counts(n, 0);
+	auto search = [&](long long from, long long to) {
+		SearchStats stats;
+		for (long long q = from; q < to; ++q) {
+			Coord p[Dim];
+			queries.point(q, p);
+			flatKNearestSearch(reference, p, k, 0, reference.size() - 1, 0, heaps.data() + q * k, counts[q], SearchOptions(), stats);
+		}
+	};
+	if (pool == nullptr) {
+		search(0, n);
+	} else {
+		TaskGroup group;
+		for (long long from = 0; from < n; from += JOIN_GRAIN) {
+			long long to = min(n, from + JOIN_GRAIN);
+			pool->submit(group, [&search, from, to]() { search(from, to); });
+		}
+		pool->wait(group);
+	}
+	knnGraphFromHeaps<Metric>(heaps, counts, k, k, false, graph);
+}
+
+#endif //KD_TREE_DUAL_TREE_H
@@ -0,0 +1,1064 @@
+#pragma clang diagnostic push
+#ifndef KD_TREE_FLAT_KDTREE_H
+#define KD_TREE_FLAT_KDTREE_H
+
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "geo_simd.h"
+#include "kdtree.h"
+
+using namespace std;
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+
+// default number of points per leaf bucket, override with -DKDTREE_LEAF_SIZE=n
+#ifndef KDTREE_LEAF_SIZE
+#define KDTREE_LEAF_SIZE 16
+#endif
+
+const int LEAF_SCAN_BLOCK = 64; // leaves are scanned this many points at a time
+const double EARTH_RADIUS = 6371; // km, the same sphere as getDist
+
+// Metric policies. distance() returns a value that is only compared with other values of the same metric,
+// planeBound() is what a point across the splitting plane at offset diff = split - q[axis] is at least,
+// boxBound() is a lower bound of the distance from q to any point of the box [lo, hi], report() turns the
+// compared value into the distance shown to the user and compared() goes the other way. TreeData is what
+// prepare() precomputes for every point of a tree; a search turns its query point into query(q) once, and
+// distanceTo() and distances() evaluate that against one point or a block of points of the tree. Metrics that can also bound the distance between two boxes (boxPairBound()
+// and boxPairSpan()) support the dual-tree joins of dual_tree.h.
+
+// Great-circle distance between (latitude, longitude) pairs given in degrees, compared as the haversine
+// value a (see geo_simd.h) and reported in km
+struct HaversineMetric {
+	typedef GeoColumns TreeData;
+
+	static double distance(const double *a, const double *b) {
+		return haversineA(geoPoint(a[0], a[1]), geoPoint(b[0], b[1]));
+	}
+
+	// see splitBound
+	static double planeBound(const double *q, int axis, double diff) {
+		return compared(splitBound(q[0], q[1], axis, diff));
+	}
+
+	// Exact distance from q to a latitude/longitude box. Inside the box's longitude span the closest point
+	// is straight north or south. Otherwise it lies on the edge meridian that is nearer in longitude (going
+	// around the antimeridian if that is shorter): either at the foot of the perpendicular from q to that
+	// meridian, when the foot falls within the box's latitudes, or at one of the edge's two corners.
+	static double boxBound(const double *q, const double *lo, const double *hi) {
+		double lat = q[0], lng = q[1];
+		if (hi[1] - lo[1] >= 360 || (lng >= lo[1] && lng <= hi[1])) {
+			double half = max(0.0, max(lo[0] - lat, lat - hi[0])) * M_PI / 360.0;
+			return sin(half) * sin(half);
+		}
+		double gapLo = longitudeGap(lng, lo[1]), gapHi = longitudeGap(lng, hi[1]);
+		double edge = gapLo < gapHi ? lo[1] : hi[1], gap = min(gapLo, gapHi) * M_PI / 180.0;
+		double loCorner[2] = {lo[0], edge}, hiCorner[2] = {hi[0], edge};
+		double corners = min(distance(q, loCorner), distance(q, hiCorner));
+		if (gap >= M_PI / 2) {
+			return corners; // the distance only grows towards the middle of the edge
+		}
+		double phi = lat * M_PI / 180.0;
+		double foot = atan(tan(phi) / cos(gap)) * 180.0 / M_PI;
+		if (foot < lo[0] || foot > hi[0]) {
+			return corners;
+		}
+		return meridianBound(cos(phi) * sin(gap));
+	}
+
+	static double report(double a) {
+		return haversineDistance(a, EARTH_RADIUS);
+	}
+
+	static double compared(double dist) {
+		double half = sin(min(dist / EARTH_RADIUS, M_PI) / 2);
+		return half * half;
+	}
+
+	template <typename Tree>
+	static void prepare(Tree &tree) {
+		tree.metricData.assign(tree.coord[0], tree.coord[1]);
+	}
+
+	static GeoPoint query(const double *q) {
+		return geoPoint(q[0], q[1]);
+	}
+
+	template <typename Tree>
+	static double distanceTo(const Tree &tree, const GeoPoint &q, long long i) {
+		const GeoColumns &points = tree.metricData;
+		return haversineA({points.lat[i], points.lng[i], points.cosLat[i]}, q);
+	}
+
+	template <typename Tree>
+	static void distances(const Tree &tree, const GeoPoint &q, long long from, int n, double *dist) {
+		haversineBlock(q, tree.metricData, from, n, dist);
+	}
+
+	// angle in degrees between two longitudes, the short way around
+	static double longitudeGap(double a, double b) {
+		double gap = fmod(fabs(a - b), 360.0);
+		return gap > 180 ? 360 - gap : gap;
+	}
+
+	// a for an arc whose sine is s (at most a quarter circle): (1 - cos) / 2, written without cancellation
+	static double meridianBound(double s) {
+		s = min(s, 1.0);
+		return s * s / (2 * (1 + sqrt(1 - s * s)));
+	}
+};
+
+// Squared straight-line distance, in any number of dimensions
+template <int Dim>
+struct EuclideanMetric {
+	struct TreeData {};
+
+	template <typename Coord>
+	static double distance(const Coord *a, const Coord *b) {
+		double sum = 0;
+		for (int d = 0; d < Dim; ++d) {
+			double diff = (double) a[d] - (double) b[d];
+			sum += diff * diff;
+		}
+		return sum;
+	}
+
+	template <typename Coord>
+	static double planeBound(const Coord *, int, double diff) {
+		return diff * diff;
+	}
+
+	template <typename Coord>
+	static double boxBound(const Coord *q, const Coord *lo, const Coord *hi) {
+		double sum = 0;
+		for (int d = 0; d < Dim; ++d) {
+			double diff = max(0.0, max((double) lo[d] - (double) q[d], (double) q[d] - (double) hi[d]));
+			sum += diff * diff;
+		}
+		return sum;
+	}
+
+	// the least and the greatest distance between a point of the box [loA, hiA] and one of [loB, hiB]
+	template <typename Coord>
+	static double boxPairBound(const Coord *loA, const Coord *hiA, const Coord *loB, const Coord *hiB) {
+		double sum = 0;
+		for (int d = 0; d < Dim; ++d) {
+			double diff = max(0.0, max((double) loB[d] - (double) hiA[d], (double) loA[d] - (double) hiB[d]));
+			sum += diff * diff;
+		}
+		return sum;
+	}
+
+	template <typename Coord>
+	static double boxPairSpan(const Coord *loA, const Coord *hiA, const Coord *loB, const Coord *hiB) {
+		double sum = 0;
+		for (int d = 0; d < Dim; ++d) {
+			double diff = max((double) hiB[d] - (double) loA[d], (double) hiA[d] - (double) loB[d]);
+			sum += diff * diff;
+		}
+		return sum;
+	}
+
+	static double report(double dist) {
+		return sqrt(dist);
+	}
+
+	static double compared(double dist) {
+		return dist * dist;
+	}
+
+	template <typename Tree>
+	static void prepare(Tree &) {}
+
+	template <typename Coord>
+	static const Coord *query(const Coord *q) {
+		return q;
+	}
+
+	template <typename Tree, typename Coord>
+	static double distanceTo(const Tree &tree, const Coord *q, long long i) {
+		double sum = 0;
+		for (int d = 0; d < Dim; ++d) {
+			double diff = (double) tree.coord[d][i] - (double) q[d];
+			sum += diff * diff;
+		}
+		return sum;
+	}
+
+	// one axis at a time over the columns, a loop the compiler vectorizes
+	template <typename Tree, typename Coord>
+	static void distances(const Tree &tree, const Coord *q, long long from, int n, double *dist) {
+		for (int i = 0; i < n; ++i) {
+			dist[i] = 0;
+		}
+		for (int d = 0; d < Dim; ++d) {
+			const Coord *c = tree.coord[d].data() + from;
+			for (int i = 0; i < n; ++i) {
+				double diff = (double) c[i] - (double) q[d];
+				dist[i] += diff * diff;
+			}
+		}
+	}
+};
+
+// Points on the unit sphere as 3D vectors, compared by squared chord length. The chord grows with the
+// great-circle angle, so ordering and pruning need no trigonometry at all and are exact everywhere,
+// including across the antimeridian and at the poles; report() converts a chord to km once.
+struct ChordMetric : EuclideanMetric<3> {
+	static double report(double chord2) {
+		return 2 * EARTH_RADIUS * asin(min(1.0, sqrt(chord2) / 2));
+	}
+
+	static double compared(double dist) {
+		double chord = 2 * sin(min(dist / EARTH_RADIUS, M_PI) / 2);
+		return chord * chord;
+	}
+};
+
+// Pointer-free KD-Tree used to answer queries. All points live in one array:
+// the subtree covering [l, r] keeps its splitting point at m = (l + r) / 2 and
+// its children are the sub-ranges [l, m - 1] and [m + 1, r], so no child links
+// are stored. A range of at most leafSize points is not split any further: it
+// is a leaf bucket that queries scan linearly. Each axis is kept in its own
+// dense array (structure of arrays), apart from the per-point item id that is
+// only read when a result is reported. The number of dimensions, the coordinate
+// type and the metric are template parameters, so the split axis and the
+// distance compile down to plain array indexing and inlined arithmetic.
+template <typename Coord, int Dim, typename Metric>
+struct BasicFlatKDTree {
+	typedef Coord CoordType;
+	typedef Metric MetricType;
+	static const int DIM = Dim;
+
+	vector<Coord> coord[Dim];
+	vector<uint32_t> item; // caller supplied id of every point (a city name id for the geographic tree)
+	long long leafSize = 1;
+	Coord lo[Dim], hi[Dim]; // bounding box of all points
+	vector<Coord> boxLo[Dim], boxHi[Dim]; // bounding box of the subtree (or leaf bucket) whose middle index is i
+	typename Metric::TreeData metricData; // per point values the metric precomputes, in tree order
+	AttributeTable attributes; // country, population and extra columns in tree order, empty if none were given
+
+	long long size() const { return (long long) item.size(); }
+	bool empty() const { return item.empty(); }
+
+	void point(long long i, Coord *p) const {
+		for (int d = 0; d < Dim; ++d) p[d] = coord[d][i];
+	}
+};
+
+// (latitude, longitude) tree, the one the CLI queries
+typedef BasicFlatKDTree<double, 2, HaversineMetric> FlatKDTree;
+
+// Earth-centered coordinates in km; used to index (latitude, longitude, altitude) or other 3D points
+typedef BasicFlatKDTree<double, 3, EuclideanMetric<3> > EcefKDTree;
+
+// (latitude, longitude) as unit vectors, for exact nearest-neighbor searches on the sphere
+typedef BasicFlatKDTree<double, 3, ChordMetric> SphereKDTree;
+
+// (latitude, longitude, altitude in km) as Earth-centered x, y, z on a spherical Earth
+void toECEF(double lat, double lng, double altitude, double *p) {
+	double phi = lat * M_PI / 180.0, lambda = lng * M_PI / 180.0, r = EARTH_RADIUS + altitude;
+	p[0] = r * cos(phi) * cos(lambda);
+	p[1] = r * cos(phi) * sin(lambda);
+	p[2] = r * sin(phi);
+}
+
+// (latitude, longitude) as a unit vector
+void toUnitVector(double lat, double lng, double *p) {
+	double phi = lat * M_PI / 180.0, lambda = lng * M_PI / 180.0;
+	p[0] = cos(phi) * cos(lambda);
+	p[1] = cos(phi) * sin(lambda);
+	p[2] = sin(phi);
+}
+
+// Compute the bounding box of the subtree [l, r] and store it at its middle index, children first. The
+// number of points in a subtree needs no storage: it is r - l + 1.
+template <typename Coord, int Dim, typename Metric>
+void buildSubtreeBoxes(BasicFlatKDTree<Coord, Dim, Metric> &tree, long long l, long long r) {
+	if (r < l) return;
+	long long m = (l + r) / 2;
+	if (r - l + 1 <= tree.leafSize) { // leaf bucket
+		for (int d = 0; d < Dim; ++d) {
+			tree.boxLo[d][m] = *min_element(tree.coord[d].begin() + l, tree.coord[d].begin() + r + 1);
+			tree.boxHi[d][m] = *max_element(tree.coord[d].begin() + l, tree.coord[d].begin() + r + 1);
+		}
+		return;
+	}
+	buildSubtreeBoxes(tree, l, m - 1);
+	buildSubtreeBoxes(tree, m + 1, r);
+	for (int d = 0; d < Dim; ++d) {
+		Coord low = tree.coord[d][m], high = tree.coord[d][m];
+		if (m > l) {
+			low = min(low, tree.boxLo[d][(l + m - 1) / 2]);
+			high = max(high, tree.boxHi[d][(l + m - 1) / 2]);
+		}
+		if (m < r) {
+			low = min(low, tree.boxLo[d][(m + 1 + r) / 2]);
+			high = max(high, tree.boxHi[d][(m + 1 + r) / 2]);
+		}
+		tree.boxLo[d][m] = low;
+		tree.boxHi[d][m] = high;
+	}
+}
+
+// Compute the attribute summaries of the subtree [l, r] and store them at its middle index, children first
+template <typename Coord, int Dim, typename Metric>
+void summarizeAttributes(BasicFlatKDTree<Coord, Dim, Metric> &tree, long long l, long long r) {
+	if (r < l) return;
+	AttributeTable &table = tree.attributes;
+	long long m = (l + r) / 2;
+	long long maxPopulation = table.population[m];
+	uint64_t countries = countryBit(table.country[m]);
+	if (r - l + 1 <= tree.leafSize) { // leaf bucket
+		for (long long i = l; i <= r; ++i) {
+			maxPopulation = max(maxPopulation, table.population[i]);
+			countries |= countryBit(table.country[i]);
+		}
+	} else {
+		summarizeAttributes(tree, l, m - 1);
+		summarizeAttributes(tree, m + 1, r);
+		if (m > l) {
+			maxPopulation = max(maxPopulation, table.subtreeMaxPopulation[(l + m - 1) / 2]);
+			countries |= table.subtreeCountries[(l + m - 1) / 2];
+		}
+		if (m < r) {
+			maxPopulation = max(maxPopulation, table.subtreeMaxPopulation[(m + 1 + r) / 2]);
+			countries |= table.subtreeCountries[(m + 1 + r) / 2];
+		}
+	}
+	table.subtreeMaxPopulation[m] = maxPopulation;
+	table.subtreeCountries[m] = countries;
+}
+
+// Build from Dim columns of coordinates (input order), one item id per point and optionally their attributes
+// (input order as well)
+template <typename Coord, int Dim, typename Metric>
+void buildFlatKDTree(BasicFlatKDTree<Coord, Dim, Metric> &tree, const vector<Coord> *columns, const vector<uint32_t> &items,
+                     TaskPool *pool = nullptr, long long leafSize = KDTREE_LEAF_SIZE, const AttributeTable *attributes = nullptr) {
+	tree.leafSize = max(leafSize, 1LL);
+	vector<long long> order = kdOrder<Coord, Dim>(columns, (long long) items.size(), 0, pool, tree.leafSize);
+	for (int d = 0; d < Dim; ++d) {
+		tree.coord[d].resize(order.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			tree.coord[d][i] = columns[d][order[i]];
+		}
+	}
+	tree.item.resize(order.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		tree.item[i] = items[order[i]];
+	}
+	tree.attributes = attributes != nullptr ? attributes->reordered(order) : AttributeTable();
+	for (int d = 0; d < Dim; ++d) {
+		if (tree.coord[d].empty()) continue;
+		tree.lo[d] = *min_element(tree.coord[d].begin(), tree.coord[d].end());
+		tree.hi[d] = *max_element(tree.coord[d].begin(), tree.coord[d].end());
+	}
+	for (int d = 0; d < Dim; ++d) {
+		tree.boxLo[d].resize(order.size());
+		tree.boxHi[d].resize(order.size());
+	}
+	buildSubtreeBoxes(tree, 0, tree.size() - 1);
+	if (!tree.attributes.empty()) {
+		tree.attributes.subtreeMaxPopulation.resize(order.size());
+		tree.attributes.subtreeCountries.resize(order.size());
+		summarizeAttributes(tree, 0, tree.size() - 1);
+	}
+	Metric::prepare(tree);
+}
+
+// The attributes of the dataset as columns in its order, with one extra column for every extra CSV column
+// one of the cities has
+AttributeTable datasetAttributes(const vector<Data> &dataset) {
+	const ExtraRows &rows = extraRows();
+	AttributeTable table;
+	vector<int> column(rows.names.size(), -1); // extraRows() column -> table column
+	for (auto &data : dataset) {
+		table.country.push_back(data.country);
+		table.population.push_back(data.population);
+		for (uint32_t k = rows.start[data.extra]; k < rows.start[data.extra + 1]; ++k) {
+			uint32_t c = rows.cells[k].first;
+			if (column[c] < 0) {
+				column[c] = (int) table.extraNames.size();
+				table.extraNames.push_back(rows.names[c]);
+				table.extra.emplace_back(dataset.size(), 0);
+			}
+		}
+	}
+	for (size_t i = 0; i < dataset.size(); ++i) {
+		for (uint32_t k = rows.start[dataset[i].extra]; k < rows.start[dataset[i].extra + 1]; ++k) {
+			table.extra[column[rows.cells[k].first]][i] = rows.cells[k].second;
+		}
+	}
+	return table;
+}
+
+FlatKDTree buildFlatKDTree(const vector<Data> &dataset, TaskPool *pool = nullptr, long long leafSize = KDTREE_LEAF_SIZE) {
+	FlatKDTree tree;
+	vector<double> columns[2];
+	vector<uint32_t> items;
+	for (auto &data : dataset) {
+		columns[0].push_back(data.latitude);
+		columns[1].push_back(data.longitude);
+		items.push_back(data.city);
+	}
+	AttributeTable attributes = datasetAttributes(dataset);
+	buildFlatKDTree(tree, columns, items, pool, leafSize, &attributes);
+	return tree;
+}
+
+SphereKDTree buildSphereKDTree(const vector<Data> &dataset, TaskPool *pool = nullptr, long long leafSize = KDTREE_LEAF_SIZE) {
+	SphereKDTree tree;
+	vector<double> columns[3];
+	vector<uint32_t> items;
+	for (auto &data : dataset) {
+		double p[3];
+		toUnitVector(data.latitude, data.longitude, p);
+		for (int d = 0; d < 3; ++d) columns[d].push_back(p[d]);
+		items.push_back(data.city);
+	}
+	AttributeTable attributes = datasetAttributes(dataset);
+	buildFlatKDTree(tree, columns, items, pool, leafSize, &attributes);
+	return tree;
+}
+
+// flatten a pointer based tree into the query layout
+FlatKDTree flattenKDTree(KDTree *root, TaskPool *pool = nullptr, long long leafSize = KDTREE_LEAF_SIZE) {
+	vector<Data> dataset;
+	NLR_Vectorify(root, dataset);
+	return buildFlatKDTree(dataset, pool, leafSize);
+}
+
+// the attributes of the point at index i copied into data, if the tree has them
+template <typename Coord, int Dim, typename Metric>
+Data withAttributes(const BasicFlatKDTree<Coord, Dim, Metric> &tree, long long i, Data data) {
+	if (!tree.attributes.empty()) {
+		data.country = tree.attributes.country[i];
+		data.population = tree.attributes.population[i];
+	}
+	return data;
+}
+
+// materialize the point stored at index i; the extra columns stay in tree.attributes
+Data flatData(const FlatKDTree &tree, long long i) {
+	return withAttributes(tree, i, {tree.item[i], tree.coord[0][i], tree.coord[1][i], 0, 0, 0});
+}
+
+Data flatData(const SphereKDTree &tree, long long i) {
+	double z = max(-1.0, min(1.0, tree.coord[2][i]));
+	return withAttributes(tree, i, {tree.item[i], asin(z) * 180.0 / M_PI, atan2(tree.coord[1][i], tree.coord[0][i]) * 180.0 / M_PI, 0, 0, 0});
+}
+
+// write the point at index i as a row under writeCSVHeader(file, tree.attributes.extraNames)
+template <typename Tree>
+void writeCSVRow(ostream &file, const Tree &tree, long long i) {
+	Data data = flatData(tree, i);
+	file << csvField(cityNames().name(data.city)) << "," << data.latitude << "," << data.longitude << ","
+	     << csvField(countryNames().name(data.country)) << "," << data.population;
+	for (size_t c = 0; c < tree.attributes.extra.size(); ++c) {
+		file << "," << csvField(tree.attributes.extraValue((int) c, i));
+	}
+	file << "\n";
+}
+
+// Distances from the query (see Metric::query) to the points [from, from + n), n <= LEAF_SCAN_BLOCK, in
+// compared units. Computing a whole block before looking at the results keeps the loop free of branches and
+// lets the metric use its vectorized kernel.
+template <typename Coord, int Dim, typename Metric, typename Query>
+void leafDistances(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Query &q, long long from, int n, double *dist) {
+	Metric::distances(tree, q, from, n, dist);
+}
+
+// Mark which of the points [from, from + n) are inside the box [lo, hi], n <= LEAF_SCAN_BLOCK
+template <typename Coord, int Dim, typename Metric>
+void leafInBox(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *lo, const Coord *hi, long long from, int n, unsigned char *inside) {
+	for (int i = 0; i < n; ++i) {
+		inside[i] = 1;
+	}
+	for (int d = 0; d < Dim; ++d) {
+		const Coord *c = tree.coord[d].data() + from;
+		for (int i = 0; i < n; ++i) {
+			inside[i] &= (c[i] >= lo[d]) & (c[i] <= hi[d]);
+		}
+	}
+}
+
+// Approximate nearest-neighbor searches. With eps > 0 a subtree is skipped as soon as its lower bound times
+// (1 + eps) reaches the distance to beat, so every result is at most (1 + eps) times as far as the true one
+// of the same rank. visitBudget > 0 stops a search after that many points have been examined and returns
+// the best found so far, without any guarantee.
+struct SearchOptions {
+	double eps;
+	long long visitBudget;
+
+	SearchOptions(double eps = 0, long long visitBudget = 0) : eps(eps), visitBudget(visitBudget) {}
+};
+
+// work done by searches, summed over their queries
+struct SearchStats {
+	long long queries = 0;
+	long long visited = 0; // points whose distance was computed
+	long long pruned = 0; // subtrees skipped because of their bound
+	long long stopped = 0; // searches cut short by the visit budget
+
+	void add(const SearchStats &other) {
+		queries += other.queries;
+		visited += other.visited;
+		pruned += other.pruned;
+		stopped += other.stopped;
+	}
+};
+
+// whether a subtree whose points are at least bound away can be skipped when best is the distance to beat,
+// both in compared units; eps scales the reported distances, whatever the metric compares
+template <typename Metric>
+bool prunable(double bound, double best, const SearchOptions &options) {
+	if (bound >= best || options.eps <= 0) return bound >= best; // no need to convert in the common case
+	return Metric::report(bound) * (1 + options.eps) >= Metric::report(best);
+}
+
+// how many of the next n points the budget still allows, marking the search as stopped when it runs out
+int budgeted(int n, const SearchOptions &options, SearchStats &stats) {
+	if (options.visitBudget <= 0) return n;
+	long long left = options.visitBudget - stats.visited;
+	if (left < n) stats.stopped = 1;
+	return (int) max(0LL, min<long long>(n, left));
+}
+
+// One pending subtree of an iterative search: the range [l, r] at depth and a lower bound of the distance
+// from the query to its points. Searches keep these on a fixed array on their own stack frame instead of
+// recursing; the tree is at most log2(size) levels deep and a search holds at most one pending sibling per
+// level plus the two children it just pushed, so FLAT_STACK_DEPTH entries are always enough.
+struct FlatFrame {
+	long long l, r;
+	int depth;
+	double bound;
+};
+
+const int FLAT_STACK_DEPTH = 66;
+
+// bestDist is in the metric's compared units here, stats are those of this one search. The nearer child
+// is always popped first and the farther one is only checked against its bound when its turn comes, by
+// which time the nearer side has usually tightened bestDist. Near-first DFS rather than best-first on
+// purpose, as in flatKNearestSearch; see history.
+template <typename Coord, int Dim, typename Metric>
+void flatNearestNeighborSearch(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, long long l, long long r, int depth, long long &best, double &bestDist,
+                               const SearchOptions &options, SearchStats &stats) {
+	auto query = Metric::query(q);
+	FlatFrame stack[FLAT_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = {l, r, depth, 0};
+	while (top > 0) {
+		FlatFrame frame = stack[--top];
+		if (frame.r < frame.l) continue;
+		if (best >= 0 && frame.bound > 0 && prunable<Metric>(frame.bound, bestDist, options)) {
+			stats.pruned++;
+			continue;
+		}
+		if (frame.r - frame.l + 1 <= tree.leafSize) { // leaf bucket
+			double dist[LEAF_SCAN_BLOCK];
+			for (long long from = frame.l; from <= frame.r; from += LEAF_SCAN_BLOCK) {
+				int n = budgeted((int) min<long long>(LEAF_SCAN_BLOCK, frame.r - from + 1), options, stats);
+				if (n == 0) return;
+				leafDistances(tree, query, from, n, dist);
+				stats.visited += n;
+				for (int i = 0; i < n; ++i) {
+					if (best < 0 || dist[i] < bestDist) {
+						bestDist = dist[i];
+						best = from + i;
+					}
+				}
+			}
+			continue;
+		}
+		if (budgeted(1, options, stats) == 0) return;
+		long long m = (frame.l + frame.r) / 2;
+		int axis = frame.depth % Dim;
+
+		Coord p[Dim];
+		tree.point(m, p);
+		double dist = Metric::distanceTo(tree, query, m);
+		stats.visited++;
+		if (best < 0 || dist < bestDist) {
+			bestDist = dist;
+			best = m;
+		}
+		if (bestDist == 0) return;
+
+		double distDim = (double) p[axis] - (double) q[axis]; // find distance in that dimension
+		double bound = Metric::planeBound(q, axis, distDim);
+		if (distDim > 0) {
+			stack[top++] = {m + 1, frame.r, frame.depth + 1, bound};
+			stack[top++] = {frame.l, m - 1, frame.depth + 1, 0};
+		} else {
+			stack[top++] = {frame.l, m - 1, frame.depth + 1, bound};
+			stack[top++] = {m + 1, frame.r, frame.depth + 1, 0};
+		}
+	}
+}
+
+// return the index of the point closest to q (-1 if the tree is empty), bestDist gets its reported distance;
+// the work done is added to stats when given
+template <typename Coord, int Dim, typename Metric>
+long long flatNearestNeighbor(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, double &bestDist,
+                              const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	long long best = -1;
+	bestDist = 0;
+	SearchStats search;
+	search.queries = 1;
+	flatNearestNeighborSearch(tree, q, 0, tree.size() - 1, 0, best, bestDist, options, search);
+	bestDist = Metric::report(bestDist);
+	if (stats != nullptr) stats->add(search);
+	return best;
+}
+
+long long flatNearestNeighbor(const FlatKDTree &tree, double lat, double lng, double &bestDist,
+                              const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	double q[2] = {lat, lng};
+	return flatNearestNeighbor(tree, q, bestDist, options, stats);
+}
+
+long long flatNearestNeighbor(const SphereKDTree &tree, double lat, double lng, double &bestDist,
+                              const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	double q[3];
+	toUnitVector(lat, lng, q);
+	return flatNearestNeighbor(tree, q, bestDist, options, stats);
+}
+
+// Position of p along a Z-order (Morton) curve over the tree's bounding box: 64 / Dim bits per axis,
+// interleaved, so points that are close in space mostly get close keys.
+template <typename Coord, int Dim, typename Metric>
+uint64_t mortonKey(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *p) {
+	const int bits = 64 / Dim;
+	const double cells = (double) ((1ULL << bits) - 1);
+	uint64_t cell[Dim];
+	for (int d = 0; d < Dim; ++d) {
+		double extent = (double) tree.hi[d] - (double) tree.lo[d];
+		double t = extent > 0 ? ((double) p[d] - (double) tree.lo[d]) / extent : 0;
+		cell[d] = (uint64_t) (min(max(t, 0.0), 1.0) * cells);
+	}
+	uint64_t key = 0;
+	for (int b = bits - 1; b >= 0; --b) {
+		for (int d = 0; d < Dim; ++d) {
+			key = (key << 1) | ((cell[d] >> b) & 1);
+		}
+	}
+	return key;
+}
+
+// (Morton key, target index) of the n targets (Dim coordinates each, one after the other) in key order
+template <typename Coord, int Dim, typename Metric>
+vector<pair<uint64_t, long long> > mortonSchedule(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *targets, long long n) {
+	vector<pair<uint64_t, long long> > schedule(n);
+	for (long long i = 0; i < n; ++i) {
+		schedule[i] = make_pair(mortonKey(tree, targets + i * Dim), i);
+	}
+	sort(schedule.begin(), schedule.end());
+	return schedule;
+}
+
+// Answer the targets listed in schedule[0..count) one after the other, each search starting from the
+// previous answer as its first candidate, which prunes from the first node when the targets are close.
+template <typename Coord, int Dim, typename Metric>
+void nearestScheduled(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *targets, const pair<uint64_t, long long> *schedule, long long count,
+                      long long *index, double *dist, const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	long long previous = -1;
+	for (long long s = 0; s < count; ++s) {
+		long long t = schedule[s].second;
+		const Coord *q = targets + t * Dim;
+		long long best = previous;
+		double bestDist = 0;
+		SearchStats search;
+		search.queries = 1;
+		if (best >= 0) {
+			bestDist = Metric::distanceTo(tree, Metric::query(q), best);
+			search.visited++;
+		}
+		flatNearestNeighborSearch(tree, q, 0, tree.size() - 1, 0, best, bestDist, options, search);
+		index[t] = best;
+		dist[t] = Metric::report(bestDist);
+		previous = best;
+		if (stats != nullptr) stats->add(search);
+	}
+}
+
+// Nearest neighbor of each of the n targets (Dim coordinates each, one after the other). The targets are
+// visited in Morton order so that consecutive searches walk mostly the same, already cached, paths.
+// index[i] and dist[i] receive the answer for targets[i] in the original order.
+template <typename Coord, int Dim, typename Metric>
+void nearestBatch(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *targets, long long n, long long *index, double *dist,
+                  const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	vector<pair<uint64_t, long long> > schedule = mortonSchedule(tree, targets, n);
+	nearestScheduled(tree, targets, schedule.data(), n, index, dist, options, stats);
+}
+
+// nearestBatch for n (latitude, longitude) pairs
+void nearestBatchLatLng(const SphereKDTree &tree, const double *latLng, long long n, long long *index, double *dist,
+                        const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+	vector<double> targets(n * 3);
+	for (long long i = 0; i < n; ++i) {
+		toUnitVector(latLng[2 * i], latLng[2 * i + 1], &targets[3 * i]);
+	}
+	nearestBatch(tree, targets.data(), n, index, dist, options, stats);
+}
+
+// one kNN result: index of the point in the tree and its distance
+struct Neighbor {
+	double dist;
+	long long index;
+
+	bool operator<(const Neighbor &other) const { return dist < other.dist; }
+};
+
+// offer a candidate to the max-heap heap[0..count) holding the k best so far
+void offerNeighbor(Neighbor *heap, int &count, int k, double dist, long long index) {
+	if (count < k) {
+		heap[count++] = {dist, index};
+		push_heap(heap, heap + count);
+	} else if (dist < heap[0].dist) {
+		pop_heap(heap, heap + count);
+		heap[count - 1] = {dist, index};
+		push_heap(heap, heap + count);
+	}
+}
+
+// Filters restrict a search to some of the points: point(i) tells whether the point at index i passes and
+// subtree(m) is false when no point of the subtree whose middle index is m can pass. The default one passes
+// everything and compiles away.
+struct AcceptAll {
+	bool subtree(long long) const { return true; }
+	bool point(long long) const { return true; }
+};
+
+// heap[0..count) is a max-heap of the best candidates, its top is the distance to beat once it is full; only
+// points the filter passes become candidates
+template <typename Coord, int Dim, typename Metric, typename Filter = AcceptAll>
+void flatKNearestSearch(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, int k, long long l, long long r, int depth, Neighbor *heap, int &count,
+                        const SearchOptions &options, SearchStats &stats, const Filter &filter = Filter()) {
+	auto query = Metric::query(q);
+	FlatFrame stack[FLAT_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = {l, r, depth, 0};
+	while (top > 0) {
+		FlatFrame frame = stack[--top];
+		if (frame.r < frame.l) continue;
+		if ((count == k && frame.bound > 0 && prunable<Metric>(frame.bound, heap[0].dist, options)) || !filter.subtree((frame.l + frame.r) / 2)) {
+			stats.pruned++;
+			continue;
+		}
+		if (frame.r - frame.l + 1 <= tree.leafSize) { // leaf bucket
+			double dist[LEAF_SCAN_BLOCK];
+			for (long long from = frame.l; from <= frame.r; from += LEAF_SCAN_BLOCK) {
+				int n = budgeted((int) min<long long>(LEAF_SCAN_BLOCK, frame.r - from + 1), options, stats);
+				if (n == 0) return;
+				leafDistances(tree, query, from, n, dist);
+				stats.visited += n;
+				for (int i = 0; i < n; ++i) {
+					if (filter.point(from + i)) offerNeighbor(heap, count, k, dist[i], from + i);
+				}
+			}
+			continue;
+		}
+		if (budgeted(1, options, stats) == 0) return;
+		long long m = (frame.l + frame.r) / 2;
+		int axis = frame.depth % Dim;
+
+		Coord p[Dim];
+		tree.point(m, p);
+		if (filter.point(m)) offerNeighbor(heap, count, k, Metric::distanceTo(tree, query, m), m);
+		stats.visited++;
+
+		double distDim = (double) p[axis] - (double) q[axis];
+		double bound = Metric::planeBound(q, axis, distDim);
+		if (distDim > 0) {
+			stack[top++] = {m + 1, frame.r, frame.depth + 1, bound};
+			stack[top++] = {frame.l, m - 1, frame.depth + 1, 0};
+		} else {
+			stack[top++] = {frame.l, m - 1, frame.depth + 1, bound};
+			stack[top++] = {m + 1, frame.r, frame.depth + 1, 0};
+		}
+	}
+}
+
+// Write the (up to) k points closest to q that the filter passes into out[0..k), nearest first, and return
+// how many were written. out doubles as the candidate heap, so the search itself does not allocate.
+template <typename Coord, int Dim, typename Metric, typename Filter = AcceptAll>
+int kNearest(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, int k, Neighbor *out,
+             const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr, const Filter &filter = Filter()) {
+	int count = 0;
+	if (k <= 0) return 0;
+	SearchStats search;
+	search.queries = 1;
+	flatKNearestSearch(tree, q, k, 0, tree.size() - 1, 0, out, count, options, search, filter);
+	sort_heap(out, out + count);
+	for (int i = 0; i < count; ++i) {
+		out[i].dist = Metric::report(out[i].dist);
+	}
+	if (stats != nullptr) stats->add(search);
+	return count;
+}
+
+template <typename Filter = AcceptAll>
+int kNearest(const FlatKDTree &tree, double lat, double lng, int k, Neighbor *out,
+             const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr, const Filter &filter = Filter()) {
+	double q[2] = {lat, lng};
+	return kNearest(tree, q, k, out, options, stats, filter);
+}
+
+template <typename Filter = AcceptAll>
+int kNearest(const SphereKDTree &tree, double lat, double lng, int k, Neighbor *out,
+             const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr, const Filter &filter = Filter()) {
+	double q[3];
+	toUnitVector(lat, lng, q);
+	return kNearest(tree, q, k, out, options, stats, filter);
+}
+
+// [lo, hi] is the region of the subtree [l, r]; radius is in compared units
+template <typename Coord, int Dim, typename Metric>
+void flatRadiusSearch(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, double radius, long long l, long long r, int depth,
+                      const Coord *lo, const Coord *hi, vector<Neighbor> &result) {
+	struct Frame { // a FlatFrame with the region of the subtree instead of a bound
+		long long l, r;
+		int depth;
+		Coord lo[Dim], hi[Dim];
+	};
+	auto query = Metric::query(q);
+	Frame stack[FLAT_STACK_DEPTH];
+	int top = 0;
+	Frame &root = stack[top++];
+	root.l = l;
+	root.r = r;
+	root.depth = depth;
+	copy(lo, lo + Dim, root.lo);
+	copy(hi, hi + Dim, root.hi);
+	while (top > 0) {
+		Frame frame = stack[--top];
+		if (frame.r < frame.l || Metric::boxBound(q, frame.lo, frame.hi) > radius) continue;
+		if (frame.r - frame.l + 1 <= tree.leafSize) { // leaf bucket
+			double dist[LEAF_SCAN_BLOCK];
+			for (long long from = frame.l; from <= frame.r; from += LEAF_SCAN_BLOCK) {
+				int n = (int) min<long long>(LEAF_SCAN_BLOCK, frame.r - from + 1);
+				leafDistances(tree, query, from, n, dist);
+				for (int i = 0; i < n; ++i) {
+					if (dist[i] <= radius) result.push_back({dist[i], from + i});
+				}
+			}
+			continue;
+		}
+		long long m = (frame.l + frame.r) / 2;
+		int axis = frame.depth % Dim;
+
+		Coord p[Dim];
+		tree.point(m, p);
+		double dist = Metric::distanceTo(tree, query, m);
+		if (dist <= radius) {
+			result.push_back({dist, m});
+		}
+
+		// the right child goes first so that the left one is popped first, as in a recursive walk
+		Frame &right = stack[top++];
+		right = frame;
+		right.l = m + 1;
+		right.depth++;
+		right.lo[axis] = p[axis];
+		Frame &left = stack[top++];
+		left = frame;
+		left.r = m - 1;
+		left.depth++;
+		left.hi[axis] = p[axis];
+	}
+}
+
+// Append every point within radius (reported units, km for the geographic tree) of q to result, optionally
+// sorted nearest first. Subtrees are skipped using the metric's lower bound for their region.
+template <typename Coord, int Dim, typename Metric>
+void radiusQuery(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *q, double radius, vector<Neighbor> &result, bool sorted = false) {
+	if (tree.empty()) return;
+	size_t first = result.size();
+	flatRadiusSearch(tree, q, Metric::compared(radius), 0, tree.size() - 1, 0, tree.lo, tree.hi, result);
+	for (size_t i = first; i < result.size(); ++i) {
+		result[i].dist = Metric::report(result[i].dist);
+	}
+	if (sorted) {
+		sort(result.begin() + first, result.end());
+	}
+}
+
+void radiusQuery(const FlatKDTree &tree, double lat, double lng, double radius, vector<Neighbor> &result, bool sorted = false) {
+	double q[2] = {lat, lng};
+	radiusQuery(tree, q, radius, result, sorted);
+}
+
+// Walk the box query [lo, hi] by subtrees: whole(l, r) is called for every subtree [l, r] that lies entirely
+// inside the box, which is then not entered at all, and point(i) for each other point inside the box. Both
+// return false to end the walk early, and so does flatRangeParts() when that happened.
+template <typename Coord, int Dim, typename Metric, typename Whole, typename Point>
+bool flatRangeParts(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *lo, const Coord *hi, Whole whole, Point point) {
+	FlatFrame stack[FLAT_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = {0, tree.size() - 1, 0, 0};
+	while (top > 0) {
+		FlatFrame frame = stack[--top];
+		if (frame.r < frame.l) continue;
+		long long m = (frame.l + frame.r) / 2;
+		bool disjoint = false, contained = true;
+		for (int d = 0; d < Dim; ++d) {
+			disjoint |= tree.boxLo[d][m] > hi[d] || tree.boxHi[d][m] < lo[d];
+			contained &= tree.boxLo[d][m] >= lo[d] && tree.boxHi[d][m] <= hi[d];
+		}
+		if (disjoint) continue;
+		if (contained) {
+			if (!whole(frame.l, frame.r)) return false;
+			continue;
+		}
+		if (frame.r - frame.l + 1 <= tree.leafSize) { // leaf bucket
+			unsigned char inside[LEAF_SCAN_BLOCK];
+			for (long long from = frame.l; from <= frame.r; from += LEAF_SCAN_BLOCK) {
+				int n = (int) min<long long>(LEAF_SCAN_BLOCK, frame.r - from + 1);
+				leafInBox(tree, lo, hi, from, n, inside);
+				for (int i = 0; i < n; ++i) {
+					if (inside[i] && !point(from + i)) return false;
+				}
+			}
+			continue;
+		}
+		bool inside = true;
+		for (int d = 0; d < Dim; ++d) {
+			inside &= tree.coord[d][m] >= lo[d] && tree.coord[d][m] <= hi[d];
+		}
+		if (inside && !point(m)) return false;
+		stack[top++] = {m + 1, frame.r, frame.depth + 1, 0};
+		stack[top++] = {frame.l, m - 1, frame.depth + 1, 0};
+	}
+	return true;
+}
+
+// Call visit(i) with the index of every point inside the box [lo, hi] until it returns false, which ends the
+// query early; returns false if that happened. Points of subtrees that lie inside the box are handed over
+// without looking at them, and nothing is collected, so memory stays O(depth) for any number of hits.
+template <typename Coord, int Dim, typename Metric, typename Visitor>
+bool visitRange(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *lo, const Coord *hi, Visitor visit) {
+	return flatRangeParts(tree, lo, hi, [&visit](long long l, long long r) {
+		for (long long i = l; i <= r; ++i) {
+			if (!visit(i)) return false;
+		}
+		return true;
+	}, [&visit](long long i) {
+		return visit(i);
+	});
+}
+
+template <typename Visitor>
+bool visitRange(const FlatKDTree &tree, double leftLat, double leftLong, double rightLat, double rightLong, Visitor visit) {
+	double lo[2] = {leftLat, leftLong}, hi[2] = {rightLat, rightLong};
+	return visitRange(tree, lo, hi, visit);
+}
+
+// collect indices of the points inside the box [lo, hi], at most limit of them when limit > 0
+template <typename Coord, int Dim, typename Metric>
+void flatRangeQuery(const BasicFlatKDTree<Coord, Dim, Metric> &tree, vector<long long> &result, const Coord *lo, const Coord *hi, long long limit = 0) {
+	long long left = limit;
+	visitRange(tree, lo, hi, [&](long long i) {
+		result.push_back(i);
+		return --left != 0;
+	});
+}
+
+void flatRangeQuery(const FlatKDTree &tree, vector<long long> &result, double leftLat, double leftLong, double rightLat, double rightLong) {
+	double lo[2] = {leftLat, leftLong}, hi[2] = {rightLat, rightLong};
+	flatRangeQuery(tree, result, lo, hi);
+}
+
+// number of points inside the box [lo, hi]; subtrees inside the box count in O(1)
+template <typename Coord, int Dim, typename Metric>
+long long rangeCount(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const Coord *lo, const Coord *hi) {
+	long long count = 0;
+	flatRangeParts(tree, lo, hi, [&count](long long l, long long r) {
+		count += r - l + 1;
+		return true;
+	}, [&count](long long) {
+		++count;
+		return true;
+	});
+	return count;
+}
+
+long long rangeCount(const FlatKDTree &tree, double leftLat, double leftLong, double rightLat, double rightLong) {
+	double lo[2] = {leftLat, leftLong}, hi[2] = {rightLat, rightLong};
+	return rangeCount(tree, lo, hi);
+}
+
+// count, sum and maximum of a weight over a set of points
+struct RangeAggregate {
+	long long count = 0;
+	double sum = 0;
+	double max = -numeric_limits<double>::infinity();
+
+	void add(long long points, double weightSum, double weightMax) {
+		count += points;
+		sum += weightSum;
+		max = std::max(max, weightMax);
+	}
+};
+
+// A weight per point of a tree, in tree order, with its sum and maximum over every subtree stored at the
+// subtree's middle index, like the subtree boxes
+struct SubtreeAggregate {
+	vector<double> weight, sum, max;
+};
+
+template <typename Coord, int Dim, typename Metric>
+void aggregateSubtree(const BasicFlatKDTree<Coord, Dim, Metric> &tree, SubtreeAggregate &aggregate, long long l, long long r) {
+	if (r < l) return;
+	long long m = (l + r) / 2;
+	if (r - l + 1 <= tree.leafSize) { // leaf bucket
+		aggregate.sum[m] = accumulate(aggregate.weight.begin() + l, aggregate.weight.begin() + r + 1, 0.0);
+		aggregate.max[m] = *max_element(aggregate.weight.begin() + l, aggregate.weight.begin() + r + 1);
+		return;
+	}
+	aggregateSubtree(tree, aggregate, l, m - 1);
+	aggregateSubtree(tree, aggregate, m + 1, r);
+	aggregate.sum[m] = aggregate.weight[m];
+	aggregate.max[m] = aggregate.weight[m];
+	if (m > l) {
+		aggregate.sum[m] += aggregate.sum[(l + m - 1) / 2];
+		aggregate.max[m] = max(aggregate.max[m], aggregate.max[(l + m - 1) / 2]);
+	}
+	if (m < r) {
+		aggregate.sum[m] += aggregate.sum[(m + 1 + r) / 2];
+		aggregate.max[m] = max(aggregate.max[m], aggregate.max[(m + 1 + r) / 2]);
+	}
+}
+
+// weight[i] belongs to the point at index i of the tree
+template <typename Coord, int Dim, typename Metric>
+SubtreeAggregate buildSubtreeAggregate(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const vector<double> &weight) {
+	SubtreeAggregate aggregate;
+	aggregate.weight = weight;
+	aggregate.sum.resize(weight.size());
+	aggregate.max.resize(weight.size());
+	aggregateSubtree(tree, aggregate, 0, tree.size() - 1);
+	return aggregate;
+}
+
+// count, sum and maximum of the weights of the points inside the box [lo, hi]
+template <typename Coord, int Dim, typename Metric>
+RangeAggregate rangeAggregate(const BasicFlatKDTree<Coord, Dim, Metric> &tree, const SubtreeAggregate &aggregate, const Coord *lo, const Coord *hi) {
+	RangeAggregate result;
+	flatRangeParts(tree, lo, hi, [&](long long l, long long r) {
+		long long m = (l + r) / 2;
+		result.add(r - l + 1, aggregate.sum[m], aggregate.max[m]);
+		return true;
+	}, [&](long long i) {
+		result.add(1, aggregate.weight[i], aggregate.weight[i]);
+		return true;
+	});
+	return result;
+}
+
+#pragma clang diagnostic pop
+#endif //KD_TREE_FLAT_KDTREE_H
+
+#pragma clang diagnostic pop
@@ -0,0 +1,171 @@
+#ifndef KD_TREE_GEO_SIMD_H
+#define KD_TREE_GEO_SIMD_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEO_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Haversine kernel: the haversine value a = sin²(Δlat / 2) + cos(lat1) cos(lat2) sin²(Δlng / 2) of one
+// query against a block of points, from radians and cosines of latitude computed once per point. The
+// great-circle distance is 2 R asin(sqrt(a)) and grows with a, so searches compare a directly and take
+// the asin only for the results they report.
+//
+// sin is evaluated as a polynomial: the argument is reduced by a multiple of π into [-π/2, π/2] (the sign
+// that reduction may flip is squared away) and the Taylor series is cut after the x^15 term. For |x| <= π/2
+// that series is within |x|^17 / 17! of sin x, a relative error of at most 6.1e-12 (reached at |x| = π/2,
+// 6.02e-12 measured against sinl), and the distance derived from a stays within 1e-10 of getDist, relative
+// (measured), which is far below the precision of the coordinates.
+// Only near antipodal points, where asin(sqrt(a)) amplifies any rounding of a, libm's included, do both
+// drift apart by up to about 1e-8. The same polynomial runs in every code path, and the widest one the CPU
+// supports (AVX-512, AVX2 with FMA, or plain scalar code) is picked once at run time.
+
+// a point or query in radians with the cosine of its latitude
+struct GeoPoint {
+	double lat, lng, cosLat;
+};
+
+GeoPoint geoPoint(double latDegrees, double lngDegrees) {
+	double lat = latDegrees * M_PI / 180.0;
+	return {lat, lngDegrees * M_PI / 180.0, cos(lat)};
+}
+
+// the same for a whole set of points, one column each
+struct GeoColumns {
+	vector<double> lat, lng, cosLat;
+
+	void assign(const vector<double> &latDegrees, const vector<double> &lngDegrees) {
+		size_t n = latDegrees.size();
+		lat.resize(n);
+		lng.resize(n);
+		cosLat.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			lat[i] = latDegrees[i] * M_PI / 180.0;
+			lng[i] = lngDegrees[i] * M_PI / 180.0;
+			cosLat[i] = cos(lat[i]);
+		}
+	}
+};
+
+const double GEO_SIN_C3 = -1.0 / 6;
+const double GEO_SIN_C5 = 1.0 / 120;
+const double GEO_SIN_C7 = -1.0 / 5040;
+const double GEO_SIN_C9 = 1.0 / 362880;
+const double GEO_SIN_C11 = -1.0 / 39916800;
+const double GEO_SIN_C13 = 1.0 / 6227020800.0;
+const double GEO_SIN_C15 = -1.0 / 1307674368000.0;
+const double GEO_ROUND_SHIFT = 6755399441055744.0; // 1.5 * 2^52: adding and subtracting it rounds to an integer
+
+// sin²(x) for |x| <= 2π
+inline double geoSin2(double x) {
+	x -= nearbyint(x * (1 / M_PI)) * M_PI;
+	double x2 = x * x;
+	double s = x * (1 + x2 * (GEO_SIN_C3 + x2 * (GEO_SIN_C5 + x2 * (GEO_SIN_C7 + x2 * (GEO_SIN_C9 + x2 * (GEO_SIN_C11 + x2 * (GEO_SIN_C13 + x2 * GEO_SIN_C15)))))));
+	return s * s;
+}
+
+inline double haversineA(const GeoPoint &p, const GeoPoint &q) {
+	return geoSin2((p.lat - q.lat) / 2) + p.cosLat * q.cosLat * geoSin2((p.lng - q.lng) / 2);
+}
+
+// out[i] = a between q and point i of the columns, for i in [0, n)
+typedef void (*HaversineKernel)(const GeoPoint &q, const double *lat, const double *lng, const double *cosLat, int n, double *out);
+
+void haversineScalar(const GeoPoint &q, const double *lat, const double *lng, const double *cosLat, int n, double *out) {
+	for (int i = 0; i < n; ++i) {
+		out[i] = geoSin2((lat[i] - q.lat) / 2) + q.cosLat * cosLat[i] * geoSin2((lng[i] - q.lng) / 2);
+	}
+}
+
+#ifdef GEO_SIMD_X86
+
+__attribute__((target("avx2,fma")))
+inline __m256d geoSin2AVX2(__m256d x) {
+	__m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1 / M_PI)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	x = _mm256_fnmadd_pd(k, _mm256_set1_pd(M_PI), x);
+	__m256d x2 = _mm256_mul_pd(x, x);
+	__m256d s = _mm256_set1_pd(GEO_SIN_C15);
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C13));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C11));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C9));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C7));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C5));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(GEO_SIN_C3));
+	s = _mm256_fmadd_pd(s, x2, _mm256_set1_pd(1));
+	s = _mm256_mul_pd(s, x);
+	return _mm256_mul_pd(s, s);
+}
+
+__attribute__((target("avx2,fma")))
+void haversineAVX2(const GeoPoint &q, const double *lat, const double *lng, const double *cosLat, int n, double *out) {
+	const __m256d half = _mm256_set1_pd(0.5), qLat = _mm256_set1_pd(q.lat), qLng = _mm256_set1_pd(q.lng), qCos = _mm256_set1_pd(q.cosLat);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d sinLat = geoSin2AVX2(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(lat + i), qLat), half));
+		__m256d sinLng = geoSin2AVX2(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(lng + i), qLng), half));
+		__m256d cosProduct = _mm256_mul_pd(qCos, _mm256_loadu_pd(cosLat + i));
+		_mm256_storeu_pd(out + i, _mm256_fmadd_pd(cosProduct, sinLng, sinLat));
+	}
+	haversineScalar(q, lat + i, lng + i, cosLat + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f")))
+inline __m512d geoSin2AVX512(__m512d x) {
+	__m512d shift = _mm512_set1_pd(GEO_ROUND_SHIFT);
+	__m512d k = _mm512_sub_pd(_mm512_fmadd_pd(x, _mm512_set1_pd(1 / M_PI), shift), shift);
+	x = _mm512_fnmadd_pd(k, _mm512_set1_pd(M_PI), x);
+	__m512d x2 = _mm512_mul_pd(x, x);
+	__m512d s = _mm512_set1_pd(GEO_SIN_C15);
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C13));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C11));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C9));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C7));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C5));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(GEO_SIN_C3));
+	s = _mm512_fmadd_pd(s, x2, _mm512_set1_pd(1));
+	s = _mm512_mul_pd(s, x);
+	return _mm512_mul_pd(s, s);
+}
+
+__attribute__((target("avx512f")))
+void haversineAVX512(const GeoPoint &q, const double *lat, const double *lng, const double *cosLat, int n, double *out) {
+	const __m512d half = _mm512_set1_pd(0.5), qLat = _mm512_set1_pd(q.lat), qLng = _mm512_set1_pd(q.lng), qCos = _mm512_set1_pd(q.cosLat);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m512d sinLat = geoSin2AVX512(_mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(lat + i), qLat), half));
+		__m512d sinLng = geoSin2AVX512(_mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(lng + i), qLng), half));
+		__m512d cosProduct = _mm512_mul_pd(qCos, _mm512_loadu_pd(cosLat + i));
+		_mm512_storeu_pd(out + i, _mm512_fmadd_pd(cosProduct, sinLng, sinLat));
+	}
+	haversineScalar(q, lat + i, lng + i, cosLat + i, n - i, out + i);
+}
+
+#endif
+
+HaversineKernel selectHaversineKernel() {
+#ifdef GEO_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return haversineAVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return haversineAVX2;
+#endif
+	return haversineScalar;
+}
+
+// a between q and the points [from, from + n) of the columns
+void haversineBlock(const GeoPoint &q, const GeoColumns &points, long long from, int n, double *out) {
+	static const HaversineKernel kernel = selectHaversineKernel();
+	kernel(q, points.lat.data() + from, points.lng.data() + from, points.cosLat.data() + from, n, out);
+}
+
+// great-circle distance in km for a haversine value a, on a sphere of the given radius
+inline double haversineDistance(double a, double radius) {
+	return 2 * radius * asin(min(1.0, sqrt(max(a, 0.0))));
+}
+
+#endif //KD_TREE_GEO_SIMD_H
@@ -0,0 +1,166 @@
+#ifndef KD_TREE_KD_FOREST_H
+#define KD_TREE_KD_FOREST_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "kdtree.h"
+
+using namespace std;
+
+// one static tree of a KDForest, with the arena owning its nodes
+struct ForestComponent {
+	KDTreeArena arena;
+	KDTree *root = nullptr;
+};
+
+// Dynamic index for append-heavy feeds by the logarithmic method (Bentley–Saxe): a forest of static,
+// balanced trees where level i is either empty or holds exactly 2^i points. Adding points works like
+// adding to a binary counter: the levels that carry are merged into one new tree built by buildKDTree,
+// so every point is rebuilt O(log n) times and an insert costs O(log² n) amortized. Queries ask every
+// level and merge the answers.
+//
+// insert() only queues the point; a background thread takes everything queued so far and merges it into
+// the levels in one carry, then swaps the new levels in. Queries see queued points too, by scanning them,
+// and work on a snapshot of the levels, so they never wait for a merge to finish.
+class KDForest {
+public:
+	KDForest() : worker(&KDForest::mergeLoop, this) {}
+
+	~KDForest() {
+		{
+			lock_guard<mutex> lock(m);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	KDForest(const KDForest &) = delete;
+	KDForest &operator=(const KDForest &) = delete;
+
+	void insert(const Data &data) {
+		lock_guard<mutex> lock(m);
+		pending.push_back(data);
+		wake.notify_one();
+	}
+
+	void insert(const vector<Data> &dataset) {
+		lock_guard<mutex> lock(m);
+		pending.insert(pending.end(), dataset.begin(), dataset.end());
+		wake.notify_one();
+	}
+
+	long long size() const {
+		lock_guard<mutex> lock(m);
+		return merged + (long long) pending.size();
+	}
+
+	// wait until every point inserted so far is in a tree
+	void flush() {
+		unique_lock<mutex> lock(m);
+		idle.wait(lock, [this] { return pending.empty(); });
+	}
+
+	// nearest point to target over all levels (see nearestNeighborSearch), false if the forest is empty
+	bool nearest(const Data &target, double &bestDist, Data &best) const {
+		bool found = false;
+		bestDist = 0; // only meaningful once found
+		vector<shared_ptr<const ForestComponent> > components = snapshot([&](const Data &data) {
+			double dist = getDist(data, target);
+			if (!found || dist < bestDist) {
+				bestDist = dist;
+				best = data;
+				found = true;
+			}
+		});
+		// largest level first, the best so far then carries over so the smaller ones are pruned against it
+		for (size_t level = components.size(); level-- > 0;) {
+			if (components[level] == nullptr || components[level]->root == nullptr) continue;
+			// without a candidate the search takes the root first, so afterwards there is one
+			nearestNeighborSearch(components[level]->root, target, 0, !found, bestDist, best);
+			found = true;
+		}
+		return found;
+	}
+
+	// append the points inside the box to result
+	void range(vector<Data> &result, double leftLat, double leftLong, double rightLat, double rightLong) const {
+		vector<shared_ptr<const ForestComponent> > components = snapshot([&](const Data &data) {
+			if (isInRange(data, leftLat, leftLong, rightLat, rightLong)) result.push_back(data);
+		});
+		for (auto &component : components) {
+			if (component != nullptr) rangeQuery(component->root, result, leftLat, leftLong, rightLat, rightLong, 0);
+		}
+	}
+
+private:
+	typedef vector<shared_ptr<const ForestComponent> > Levels;
+
+	mutable mutex m;
+	condition_variable wake, idle;
+	Levels levels; // levels[i] holds 2^i points or is null
+	long long merged = 0; // points in the levels
+	vector<Data> pending; // inserted, not merged yet
+	bool stopping = false;
+	thread worker; // declared last so it starts once everything above is set up
+
+	// call visit on every pending point and return the levels, both as of the same moment
+	template <typename Visit>
+	Levels snapshot(Visit visit) const {
+		lock_guard<mutex> lock(m);
+		for (auto &data : pending) {
+			visit(data);
+		}
+		return levels;
+	}
+
+	// The levels after adding points to the levels of a forest of before points. The levels up to the highest
+	// bit in which before and after = before + points.size() differ are rebuilt from their own points and the
+	// new ones, which are exactly as many as the bits of after up to there ask for; the levels above it stay.
+	static Levels carry(const Levels &old, long long before, vector<Data> &points) {
+		long long after = before + (long long) points.size();
+		int top = 0;
+		while ((before ^ after) >> (top + 1)) ++top;
+		Levels next = old;
+		next.resize(max(old.size(), (size_t) top + 1));
+		for (int level = 0; level <= top; ++level) {
+			if (next[level] != nullptr) NLR_Vectorify(next[level]->root, points);
+			next[level] = nullptr;
+		}
+		long long from = 0;
+		for (int level = top; level >= 0; --level) {
+			if ((after >> level & 1) == 0) continue;
+			shared_ptr<ForestComponent> component = make_shared<ForestComponent>();
+			component->root = buildKDTree(component->arena, points, from, from + (1LL << level) - 1);
+			next[level] = component;
+			from += 1LL << level;
+		}
+		return next;
+	}
+
+	void mergeLoop() {
+		unique_lock<mutex> lock(m);
+		while (true) {
+			wake.wait(lock, [this] { return stopping || !pending.empty(); });
+			if (stopping) return;
+			// the batch stays pending, and visible to queries, until the levels holding it are in place
+			vector<Data> batch = pending;
+			size_t taken = batch.size();
+			Levels old = levels;
+			long long before = merged;
+			lock.unlock();
+			Levels next = carry(old, before, batch);
+			lock.lock();
+			levels = next;
+			merged += (long long) taken;
+			pending.erase(pending.begin(), pending.begin() + (long long) taken);
+			idle.notify_all();
+		}
+	}
+};
+
+#endif //KD_TREE_KD_FOREST_H
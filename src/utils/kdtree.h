@@ -7,150 +7,446 @@
 #include <sstream>
 #include <algorithm>
 #include <vector>
+#include <memory>
 #define _USE_MATH_DEFINES
 #include <cmath>
 
+#include "attributes.h"
+#include "name_pool.h"
+#include "small_stack.h"
+#include "task_pool.h"
+
 using namespace std;
 
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "misc-no-recursion"
 
 struct Data{ // NOLINT(*-pro-type-member-init)
-	std::string city;
+	uint32_t city; // id in cityNames()
 	double latitude, longitude;
+	uint32_t country; // id in countryNames()
+	long long population; // 0 when unknown
+	uint32_t extra; // row in extraRows()
 };
 
 struct KDTree{ // NOLINT(*-pro-type-member-init)
 	Data data;
 	KDTree *left, *right;
+	long long size; // nodes in the subtree rooted here
 };
 
-double getDist(Data, Data);
+// Node storage of one tree. Nodes are carved out of fixed-size blocks that stay allocated for the
+// lifetime of the arena: dropping the tree is O(1) and the next build reuses the same blocks.
+struct KDTreeArena{
+	static const size_t BLOCK_SIZE = 4096;
+
+	vector<unique_ptr<KDTree[]>> blocks;
+	size_t used = 0; // nodes handed out since the last clear
+
+	KDTree *allocate(const Data &data, KDTree *left = nullptr, KDTree *right = nullptr) {
+		if (used == blocks.size() * BLOCK_SIZE) {
+			blocks.emplace_back(new KDTree[BLOCK_SIZE]);
+		}
+		KDTree *node = &blocks[used / BLOCK_SIZE][used % BLOCK_SIZE];
+		++used;
+		node->data = data;
+		node->left = left;
+		node->right = right;
+		node->size = 1 + (left != nullptr ? left->size : 0) + (right != nullptr ? right->size : 0);
+		return node;
+	}
+
+	// forget every node at once, the blocks are kept for reuse
+	void clear() { used = 0; }
+};
+
+double getDist(double, double, double, double);
+double getDist(const Data &, const Data &);
 void nearestNeighborSearch(KDTree *, const Data &, int, bool, double &, Data &);
 bool isInRange(const Data &, double, double, double, double);
 void rangeQuery(KDTree *, double, double, double, double, int);
 vector<Data> readCSVFile(const string &filePath);
 
+// Pointer trees can be as deep as the number of insertData() calls, so they are walked with a SmallStack
+// instead of recursion; this many levels fit without touching the heap.
+const size_t TREE_STACK_DEPTH = 64;
+
 // Print KDTree in a human-friendly way. This function is used to visualize tree;
 void printKDTree(KDTree *root = nullptr, const string &prefix = "", bool isLeft = false) {
-	if (root != nullptr) {
-		cout << prefix;
-		cout << (isLeft ? "├──" : "└──");
+	struct Frame {
+		KDTree *node;
+		size_t prefixLength; // the node's prefix is path[0, prefixLength)
+		bool isLeft;
+	};
+	// Siblings share their prefix and a subtree only appends to it, so one string serves the whole walk
+	string path = prefix;
+	SmallStack<Frame, TREE_STACK_DEPTH> stack;
+	stack.push({root, path.size(), isLeft});
+	while (!stack.empty()) {
+		Frame frame = stack.pop();
+		if (frame.node == nullptr) continue;
+		path.resize(frame.prefixLength);
+		cout << path;
+		cout << (frame.isLeft ? "├──" : "└──");
 
 		// print the value of the node
 		cout.precision(4);
-		cout << root->data.city << " - (" << fixed << root->data.latitude << "; " << root->data.longitude << ")\n";
+		cout << cityNames().name(frame.node->data.city) << " - (" << fixed << frame.node->data.latitude << "; " << frame.node->data.longitude << ")\n";
 
-		// enter the next tree level - left and right branch
-		printKDTree(root->left, prefix + (isLeft ? "│   " : "    "), true);
-		printKDTree(root->right, prefix + (isLeft ? "│   " : "    "), false);
+		// enter the next tree level - left and right branch (the left one is pushed last to come out first)
+		path += frame.isLeft ? "│   " : "    ";
+		stack.push({frame.node->right, path.size(), false});
+		stack.push({frame.node->left, path.size(), true});
 	}
 }
 
-void deleteTree(KDTree *&root) {
-	if (root == nullptr) return;
-	deleteTree(root->left);
-	deleteTree(root->right);
-	delete root;
+// drop the whole tree owned by the arena
+void deleteTree(KDTreeArena &arena, KDTree *&root) {
+	arena.clear();
 	root = nullptr;
 }
 
-struct DataCompare{
-	int axis;
+template <typename Coord>
+struct IndexCompare{
+	const Coord *key;
 
-	DataCompare(int axis) : axis(axis) {} // NOLINT(*-explicit-constructor)
-	bool operator()(const Data &d1, const Data &d2) const {
-		return (axis == 0 ? d1.latitude < d2.latitude : d1.longitude < d2.longitude);
+	IndexCompare(const Coord *key) : key(key) {} // NOLINT(*-explicit-constructor)
+	bool operator()(long long i, long long j) const {
+		return key[i] < key[j];
 	}
 };
 
-// Build a balanced KDTree using quick-sort alike method to sort out the dataset
-KDTree *buildKDTree(vector<Data> &dataset, long long l = 0, long long r = 1, int depth = 0) {
-	if (r >= dataset.size() || r < l) {
+const long long PARALLEL_TASK_CUTOFF = 1 << 14; // smaller subtrees are ordered by a single task
+const long long PARALLEL_PARTITION_CUTOFF = 1 << 18; // larger ranges are partitioned by several tasks
+const long long PARTITION_CHUNK = 1 << 16; // fixed, so the result does not depend on the thread count
+
+// run body(0..chunks-1), spread over the pool when there is one
+void forEachChunk(TaskPool *pool, long long chunks, const function<void(long long)> &body) {
+	if (pool == nullptr) {
+		for (long long c = 0; c < chunks; ++c) body(c);
+		return;
+	}
+	TaskGroup group;
+	for (long long c = 0; c < chunks; ++c) {
+		pool->submit(group, [&body, c]() { body(c); });
+	}
+	pool->wait(group);
+}
+
+// Move the m-th smallest key of order[l..r] to position m, smaller keys before it and larger after it.
+// Large ranges are narrowed first by three-way partitions around the median of an evenly spaced sample;
+// every partition pass counts and then scatters fixed-size chunks in parallel, in chunk order, so the
+// output is the same with any number of threads (or none).
+template <typename Coord>
+void selectMedian(const Coord *key, vector<long long> &order, long long l, long long r, long long m, TaskPool *pool) {
+	vector<long long> buffer;
+	while (r - l + 1 > PARALLEL_PARTITION_CUTOFF) {
+		const long long samples = 257;
+		vector<Coord> sample;
+		for (long long s = 0; s < samples; ++s) {
+			sample.push_back(key[order[l + (r - l) * s / (samples - 1)]]);
+		}
+		nth_element(sample.begin(), sample.begin() + samples / 2, sample.end());
+		Coord pivot = sample[samples / 2];
+
+		long long chunks = (r - l + PARTITION_CHUNK) / PARTITION_CHUNK;
+		vector<long long> less(chunks + 1, 0), equal(chunks + 1, 0);
+		forEachChunk(pool, chunks, [&](long long c) {
+			long long from = l + c * PARTITION_CHUNK, to = min(r + 1, from + PARTITION_CHUNK);
+			long long nLess = 0, nEqual = 0;
+			for (long long i = from; i < to; ++i) {
+				Coord k = key[order[i]];
+				nLess += k < pivot;
+				nEqual += k == pivot;
+			}
+			less[c + 1] = nLess;
+			equal[c + 1] = nEqual;
+		});
+		for (long long c = 0; c < chunks; ++c) { // turn the counts into start offsets
+			less[c + 1] += less[c];
+			equal[c + 1] += equal[c];
+		}
+		long long totalLess = less[chunks], totalEqual = equal[chunks];
+		buffer.resize(r - l + 1);
+		forEachChunk(pool, chunks, [&](long long c) {
+			long long from = l + c * PARTITION_CHUNK, to = min(r + 1, from + PARTITION_CHUNK);
+			long long pl = less[c], pe = totalLess + equal[c], pg = totalLess + totalEqual + (from - l) - less[c] - equal[c];
+			for (long long i = from; i < to; ++i) {
+				Coord k = key[order[i]];
+				buffer[k < pivot ? pl++ : k == pivot ? pe++ : pg++] = order[i];
+			}
+		});
+		forEachChunk(pool, chunks, [&](long long c) {
+			long long from = c * PARTITION_CHUNK, to = min(r - l + 1, from + PARTITION_CHUNK);
+			copy(buffer.begin() + from, buffer.begin() + to, order.begin() + l + from);
+		});
+
+		if (m < l + totalLess) {
+			r = l + totalLess - 1;
+		} else if (m < l + totalLess + totalEqual) {
+			return; // the m-th key equals the pivot and is already in place
+		} else {
+			l += totalLess + totalEqual;
+		}
+	}
+	nth_element(order.begin() + l, order.begin() + m, order.begin() + r + 1, IndexCompare<Coord>(key));
+}
+
+// Put the indices of order[l..r] into KD order by median selection: the median of every range ends up at
+// (l + r) / 2 with smaller keys on its left. Each level is a linear selection over indices, so the whole
+// pass is O(n log n) and no Data is copied. With a pool, subtrees above PARALLEL_TASK_CUTOFF become tasks
+// of the group; the order produced is the same as without one. Ranges of at most leafSize points are left
+// as they are (leaf buckets). The split axis cycles through the Dim key arrays.
+template <typename Coord, int Dim>
+void selectKDOrder(const vector<Coord> *keys, vector<long long> &order, long long l, long long r, int depth = 0,
+                   TaskPool *pool = nullptr, TaskGroup *group = nullptr, long long leafSize = 1) {
+	if (r - l + 1 <= leafSize) return;
+	long long m = (l + r) / 2;
+	selectMedian(keys[depth % Dim].data(), order, l, r, m, pool);
+	if (pool != nullptr && r - l + 1 > PARALLEL_TASK_CUTOFF) {
+		pool->submit(*group, [keys, &order, l, m, depth, pool, group, leafSize]() {
+			selectKDOrder<Coord, Dim>(keys, order, l, m - 1, depth + 1, pool, group, leafSize);
+		});
+	} else {
+		selectKDOrder<Coord, Dim>(keys, order, l, m - 1, depth + 1, pool, group, leafSize);
+	}
+	selectKDOrder<Coord, Dim>(keys, order, m + 1, r, depth + 1, pool, group, leafSize);
+}
+
+// KD order of the points given by Dim key arrays of size n, as a list of point indices
+template <typename Coord, int Dim>
+vector<long long> kdOrder(const vector<Coord> *keys, long long n, int depth = 0, TaskPool *pool = nullptr, long long leafSize = 1) {
+	vector<long long> order(n);
+	for (long long i = 0; i < n; ++i) {
+		order[i] = i;
+	}
+	TaskGroup group;
+	selectKDOrder<Coord, Dim>(keys, order, 0, n - 1, depth, pool, &group, leafSize);
+	if (pool != nullptr) {
+		pool->wait(group);
+	}
+	return order;
+}
+
+// KD order of dataset[l..r] as a list of dataset indices, starting with axis depth % 2
+vector<long long> kdOrder(const vector<Data> &dataset, long long l, long long r, int depth = 0, TaskPool *pool = nullptr, long long leafSize = 1) {
+	vector<double> keys[2];
+	for (long long i = l; i <= r; ++i) {
+		keys[0].push_back(dataset[i].latitude);
+		keys[1].push_back(dataset[i].longitude);
+	}
+	vector<long long> order = kdOrder<double, 2>(keys, r - l + 1, depth, pool, leafSize);
+	for (auto &i : order) {
+		i += l;
+	}
+	return order;
+}
+
+// link the nodes of order[l..r], which is already in KD order
+KDTree *linkKDTree(KDTreeArena &arena, const vector<Data> &dataset, const vector<long long> &order, long long l, long long r) {
+	if (r < l) {
 		return nullptr;
 	}
-	sort(dataset.begin() + l, dataset.begin() + r + 1, DataCompare(depth % 2)); //sort with input axis depth % 2
 	long long m = (l + r) / 2;
+	return arena.allocate(
+		dataset[order[m]], // the median is the node at that location
+		linkKDTree(arena, dataset, order, l, m - 1),
+		linkKDTree(arena, dataset, order, m + 1, r)
+	);
+}
 
-	return new KDTree{
-		dataset[m], // the median is the node at that location
-		buildKDTree(dataset, l, m - 1, depth + 1),
-		buildKDTree(dataset, m + 1, r, depth + 1)
-	};
+// Compute the size of every subtree of a tree whose nodes were linked without it
+void computeSizes(KDTree *root) {
+	vector<KDTree *> nodes; // parents before children, so children come first backwards
+	SmallStack<KDTree *, TREE_STACK_DEPTH> stack;
+	stack.push(root);
+	while (!stack.empty()) {
+		KDTree *node = stack.pop();
+		if (node == nullptr) continue;
+		nodes.push_back(node);
+		stack.push(node->right);
+		stack.push(node->left);
+	}
+	for (size_t i = nodes.size(); i-- > 0;) {
+		KDTree *node = nodes[i];
+		node->size = 1 + (node->left != nullptr ? node->left->size : 0) + (node->right != nullptr ? node->right->size : 0);
+	}
 }
 
-// insert data without caring about balancing problem
-bool insertData(KDTree *&root, Data &data, int depth = 0) {
-	if (root == nullptr) {
-		root = new KDTree{data, nullptr, nullptr};
-		return true;
+// Build a balanced KDTree, choosing the median of each level by selection instead of sorting
+KDTree *buildKDTree(KDTreeArena &arena, vector<Data> &dataset, long long l = 0, long long r = 1, int depth = 0, TaskPool *pool = nullptr) {
+	if (r >= (long long) dataset.size() || r < l) {
+		return nullptr;
 	}
-	if (depth % 2 == 0) {
-		return insertData((data.latitude < root->data.latitude) ? root->left : root->right, data, depth + 1);
+	vector<long long> order = kdOrder(dataset, l, r, depth, pool);
+	return linkKDTree(arena, dataset, order, 0, (long long) order.size() - 1);
+}
+
+// insert data without caring about balancing problem
+bool insertData(KDTreeArena &arena, KDTree *&root, Data &data, int depth = 0) {
+	KDTree **link = &root;
+	for (; *link != nullptr; ++depth) {
+		KDTree *node = *link;
+		node->size++;
+		bool left = depth % 2 == 0 ? data.latitude < node->data.latitude : data.longitude < node->data.longitude;
+		link = left ? &node->left : &node->right;
 	}
-	return insertData((data.longitude < root->data.longitude) ? root->left : root->right, data, depth + 1);
+	*link = arena.allocate(data);
+	return true;
 }
 
 // post order traversal to get a list of all nodes in post order
 void NLR_Vectorify(KDTree *root, vector<Data> &dataset) {
-	if (root == nullptr) return;
-	dataset.push_back(root->data);
-	NLR_Vectorify(root->left, dataset);
-	NLR_Vectorify(root->right, dataset);
+	SmallStack<KDTree *, TREE_STACK_DEPTH> stack;
+	stack.push(root);
+	while (!stack.empty()) {
+		KDTree *node = stack.pop();
+		if (node == nullptr) continue;
+		dataset.push_back(node->data);
+		stack.push(node->right);
+		stack.push(node->left);
+	}
+}
+
+// Balance factor of the scapegoat inserts below, in (0.5, 1): a subtree is out of balance when one of its
+// children holds more than this share of its nodes. Lower values keep the tree shallower at the price of
+// more frequent rebuilds.
+#ifndef KDTREE_BALANCE
+#define KDTREE_BALANCE 0.7
+#endif
+
+// link the nodes[next..] taken in turn to the KD ordered dataset entries order[l..r]
+KDTree *relinkKDTree(const vector<KDTree *> &nodes, size_t &next, const vector<Data> &dataset, const vector<long long> &order, long long l, long long r) {
+	if (r < l) {
+		return nullptr;
+	}
+	long long m = (l + r) / 2;
+	KDTree *node = nodes[next++];
+	node->data = dataset[order[m]];
+	node->left = relinkKDTree(nodes, next, dataset, order, l, m - 1);
+	node->right = relinkKDTree(nodes, next, dataset, order, m + 1, r);
+	node->size = r - l + 1;
+	return node;
 }
 
-// Insert then rebuild
-void insertDataBalance(KDTree *&root, Data data) {
+// Rebuild the subtree at link, whose root is at depth, into a balanced one made of the same nodes
+void rebuildSubtree(KDTree *&link, int depth, TaskPool *pool = nullptr) {
+	vector<KDTree *> nodes;
 	vector<Data> dataset;
-	NLR_Vectorify(root, dataset);
-//	cout << "Insert (" << data.city << ", " << data.latitude << ", " << data.longitude << ")\n";
-	dataset.push_back(data);
-	deleteTree(root);
-	// rebuild the tree with new dataset
-	root = buildKDTree(dataset, 0, (long long) dataset.size() - 1);
+	SmallStack<KDTree *, TREE_STACK_DEPTH> stack;
+	stack.push(link);
+	while (!stack.empty()) {
+		KDTree *node = stack.pop();
+		if (node == nullptr) continue;
+		nodes.push_back(node);
+		dataset.push_back(node->data);
+		stack.push(node->right);
+		stack.push(node->left);
+	}
+	vector<long long> order = kdOrder(dataset, 0, (long long) dataset.size() - 1, depth, pool);
+	size_t next = 0;
+	link = relinkKDTree(nodes, next, dataset, order, 0, (long long) order.size() - 1);
+}
+
+// Insert data as a leaf, then keep the tree balanced scapegoat style: when the new node lies deeper than
+// log(n) / log(1 / alpha), the lowest subtree on its path whose child on the path holds more than alpha of
+// its nodes is rebuilt, and nothing else is touched. An insert costs O(log² n) amortized instead of the
+// O(n log n) of rebuilding the whole tree.
+void insertDataBalance(KDTreeArena &arena, KDTree *&root, Data data, TaskPool *pool = nullptr, double alpha = KDTREE_BALANCE) {
+//	cout << "Insert (" << cityNames().name(data.city) << ", " << data.latitude << ", " << data.longitude << ")\n";
+	SmallStack<KDTree **, TREE_STACK_DEPTH> path; // links to the ancestors of the new node, the root first
+	KDTree **link = &root;
+	int depth = 0;
+	for (; *link != nullptr; ++depth) {
+		KDTree *node = *link;
+		path.push(link);
+		node->size++;
+		bool left = depth % 2 == 0 ? data.latitude < node->data.latitude : data.longitude < node->data.longitude;
+		link = left ? &node->left : &node->right;
+	}
+	*link = arena.allocate(data);
+	if (depth <= log((double) root->size) / log(1 / alpha)) return;
+
+	long long childSize = 1;
+	while (!path.empty()) {
+		KDTree **ancestor = path.pop();
+		--depth;
+		if (childSize > alpha * (double) (*ancestor)->size) {
+			rebuildSubtree(*ancestor, depth, pool);
+			return;
+		}
+		childSize = (*ancestor)->size;
+	}
 }
 
 // read csv, insert the new and rebuild the tree
-void insertBalanceFromCSV(KDTree *& root, const string &filePath) {
+void insertBalanceFromCSV(KDTreeArena &arena, KDTree *& root, const string &filePath, TaskPool *pool = nullptr) {
 	vector<Data> dataset = readCSVFile(filePath);
 	NLR_Vectorify(root, dataset);
-	deleteTree(root);
-	root = buildKDTree(dataset, 0, (long long) dataset.size() - 1);
+	deleteTree(arena, root);
+	root = buildKDTree(arena, dataset, 0, (long long) dataset.size() - 1, 0, pool);
 }
 
-// get distance
-double getDist(Data x, Data y) {
+// get distance between two (latitude, longitude) pairs
+double getDist(double lat1, double long1, double lat2, double long2) {
 	// compute latitude and longitude distance
-	double distLat = (y.latitude - x.latitude) * M_PI / 180.0;
-	double distLong = (y.longitude - x.longitude) * M_PI / 180.0;
+	double distLat = (lat2 - lat1) * M_PI / 180.0;
+	double distLong = (long2 - long1) * M_PI / 180.0;
 
 	// convert to radians
-	x.latitude = (x.latitude * M_PI) / 180.0;
-	y.latitude = (y.latitude * M_PI) / 180.0;
+	lat1 = (lat1 * M_PI) / 180.0;
+	lat2 = (lat2 * M_PI) / 180.0;
 
 	// formula
-	double a = pow(sin(distLat / 2), 2) + pow(sin(distLong / 2), 2) * cos(x.latitude) * cos(y.latitude);
+	double a = pow(sin(distLat / 2), 2) + pow(sin(distLong / 2), 2) * cos(lat1) * cos(lat2);
 	double rad = 6371;
 	double c = 2 * asin(sqrt(a));
 	return rad * c;
 }
 
-void nearestNeighborSearch(KDTree *root, const Data &targ, int depth, bool noCandidate, double &bestDist, Data &bestData) {
-	if (root == nullptr) return;
+// get distance
+double getDist(const Data &x, const Data &y) {
+	return getDist(x.latitude, x.longitude, y.latitude, y.longitude);
+}
 
-	double dist = getDist(root->data, targ);
-	if (noCandidate || dist < bestDist) {
-		bestDist = dist;
-		bestData = root->data;
-		noCandidate = false;
-	}
-	if (bestDist == 0) return;
+// Least great-circle distance in km (the sphere of getDist) from (lat, lng) to a point on the far side of a
+// split diff = split - q degrees away on axis 0 (latitude) or 1 (longitude). The far side of a latitude split
+// is at least the meridian arc away. The far side of a longitude split reaches to the antimeridian, so its
+// nearest meridian is either the split or the antimeridian, and the distance to a meridian at angle gap is
+// asin(cos(lat) * sin(gap)) up to the pole. The flat trees' haversine metric uses it too.
+double splitBound(double lat, double lng, int axis, double diff) {
+	if (axis == 0) return 6371 * min(fabs(diff), 180.0) * M_PI / 180.0;
+	double gap = diff > 0 ? min(diff, 180 + lng) : min(-diff, 180 - lng);
+	gap = min(max(gap, 0.0), 90.0) * M_PI / 180.0;
+	return 6371 * asin(min(1.0, cos(lat * M_PI / 180.0) * sin(gap)));
+}
 
-	double distDim = (depth % 2 == 0 ? root->data.latitude - targ.latitude : root->data.longitude - targ.longitude); // find distance in that dimension
-	(depth += 1) %= 2;
-	nearestNeighborSearch(distDim > 0 ? root->left : root->right, targ, depth, noCandidate, bestDist, bestData);
-	if ((long double) distDim * (long double) distDim >= bestDist) return;
-	nearestNeighborSearch(distDim > 0 ? root->right : root->left, targ, depth, noCandidate, bestDist, bestData);
+void nearestNeighborSearch(KDTree *root, const Data &targ, int depth, bool noCandidate, double &bestDist, Data &bestData) {
+	struct Frame {
+		KDTree *node;
+		int depth;
+		double bound; // splitBound() of the far side, which is skipped once bestDist is within it; -1 on the near side
+	};
+	SmallStack<Frame, TREE_STACK_DEPTH> stack;
+	stack.push({root, depth, -1});
+	while (!stack.empty()) {
+		Frame frame = stack.pop();
+		if (frame.node == nullptr || (!noCandidate && frame.bound >= bestDist)) continue;
+		KDTree *node = frame.node;
+
+		double dist = getDist(node->data, targ);
+		if (noCandidate || dist < bestDist) {
+			bestDist = dist;
+			bestData = node->data;
+			noCandidate = false;
+		}
+		if (bestDist == 0) return;
+
+		double distDim = (frame.depth % 2 == 0 ? node->data.latitude - targ.latitude : node->data.longitude - targ.longitude); // find distance in that dimension
+		int next = (frame.depth + 1) % 2;
+		stack.push({distDim > 0 ? node->right : node->left, next, splitBound(targ.latitude, targ.longitude, frame.depth % 2, distDim)});
+		stack.push({distDim > 0 ? node->left : node->right, next, -1});
+	}
 }
 
 bool isInRange(const Data &city, double leftLat, double leftLong, double rightLat, double rightLong) {
@@ -159,18 +455,66 @@ bool isInRange(const Data &city, double leftLat, double leftLong, double rightLa
 
 // post order with dimension, used to query out those nodes inside the box
 void rangeQuery(KDTree *root, vector <Data> &result, double leftLat, double leftLong, double rightLat, double rightLong, int depth) {
-	if (root == nullptr) return;
-	if (isInRange(root->data, leftLat, leftLong, rightLat, rightLong)) {
-		result.push_back({root->data.city, root->data.latitude, root->data.longitude});
+	SmallStack<pair<KDTree *, int>, TREE_STACK_DEPTH> stack;
+	stack.push(make_pair(root, depth));
+	while (!stack.empty()) {
+		pair<KDTree *, int> top = stack.pop();
+		KDTree *node = top.first;
+		int level = top.second;
+		if (node == nullptr) continue;
+		if (isInRange(node->data, leftLat, leftLong, rightLat, rightLong)) {
+			result.push_back(node->data);
+		}
+		// the left branch is pushed last so that it is visited first
+		// keys equal to the node's can be on either side, so a box edge on the split needs both
+		if ((level % 2 == 0 && node->data.latitude <= rightLat) || (level % 2 == 1 && node->data.longitude <= rightLong)) {
+			stack.push(make_pair(node->right, level + 1));
+		}
+		if ((level % 2 == 0 && node->data.latitude >= leftLat) || (level % 2 == 1 && node->data.longitude >= leftLong)) {
+			stack.push(make_pair(node->left, level + 1));
+		}
 	}
-	if ((depth % 2 == 0 && root->data.latitude > leftLat) || (depth % 2 == 1 && root->data.longitude > leftLong)) {
-		rangeQuery(root->left, result, leftLat, leftLong, rightLat, rightLong, depth + 1);
+}
+
+// Split one CSV line into its cells. A cell in double quotes may hold commas, and "" inside it is a quote.
+void splitCSVRow(const string &line, vector<string> &cells) {
+	cells.assign(1, string());
+	bool quoted = false;
+	for (size_t i = 0; i < line.size(); ++i) {
+		char c = line[i];
+		if (quoted) {
+			if (c != '"') {
+				cells.back() += c;
+			} else if (i + 1 < line.size() && line[i + 1] == '"') {
+				cells.back() += '"';
+				++i;
+			} else {
+				quoted = false;
+			}
+		} else if (c == '"') {
+			quoted = true;
+		} else if (c == ',') {
+			cells.emplace_back();
+		} else if (c != '\r') {
+			cells.back() += c;
+		}
 	}
-	if ((depth % 2 == 0 && root->data.latitude < rightLat) || (depth % 2 == 1 && root->data.longitude < rightLong)) {
-		rangeQuery(root->right, result, leftLat, leftLong, rightLat, rightLong, depth + 1);
+}
+
+// a cell as written to a CSV file, quoted when it has to be
+string csvField(const string &text) {
+	if (text.find_first_of(",\"\n") == string::npos) return text;
+	string quoted = "\"";
+	for (char c : text) {
+		if (c == '"') quoted += '"';
+		quoted += c;
 	}
+	return quoted + "\"";
 }
 
+// Read the cities of a CSV file. Columns are found by their name in the header: city, lat, lng, country and
+// population, every other one is kept as an extra column (see extraRows()). A header without lat and lng is
+// taken to start with city, lat, lng and the rest of it is ignored.
 vector<Data> readCSVFile(const string &filePath) {
 	ifstream file(filePath.c_str());
 	vector<Data> dataset;
@@ -179,31 +523,100 @@ vector<Data> readCSVFile(const string &filePath) {
 		return dataset;
 	}
 	string tmp;
-	getline(file, tmp); // skip header
+	vector<string> cells;
+	getline(file, tmp);
+	splitCSVRow(tmp, cells);
+	size_t cityColumn = 0, latColumn = 1, lngColumn = 2, countryColumn = string::npos, populationColumn = string::npos;
+	vector<pair<size_t, uint32_t> > extraColumns; // (cell, column in extraRows())
+	if (find(cells.begin(), cells.end(), "lat") != cells.end() && find(cells.begin(), cells.end(), "lng") != cells.end()) {
+		cityColumn = string::npos;
+		for (size_t c = 0; c < cells.size(); ++c) {
+			if (cells[c] == "city") cityColumn = c;
+			else if (cells[c] == "lat") latColumn = c;
+			else if (cells[c] == "lng") lngColumn = c;
+			else if (cells[c] == "country") countryColumn = c;
+			else if (cells[c] == "population") populationColumn = c;
+			else extraColumns.push_back(make_pair(c, extraRows().column(cells[c])));
+		}
+	}
+	vector<pair<uint32_t, uint32_t> > extra;
 	while (getline(file, tmp)) {
+		splitCSVRow(tmp, cells);
+		if (cells.size() <= max(latColumn, lngColumn)) continue;
 		Data data;
-		size_t p1 = tmp.find(',');
-		size_t p2 = tmp.find(',', p1 + 1);
-		data.city = tmp.substr(0, p1);
-		if (p2 <= p1) continue;
-		data.latitude = stod(tmp.substr(p1 + 1, p2 - p1 - 1));
-		p1 = tmp.find(',', p2 + 1);
-		if (p1 <= p2) continue;
-		data.longitude = stod(tmp.substr(p2 + 1, p1));
+		data.city = cityNames().intern(cityColumn < cells.size() ? cells[cityColumn] : "");
+		data.latitude = stod(cells[latColumn]);
+		data.longitude = stod(cells[lngColumn]);
+		data.country = countryNames().intern(countryColumn < cells.size() ? cells[countryColumn] : "");
+		data.population = populationColumn < cells.size() ? (long long) atof(cells[populationColumn].c_str()) : 0;
+		extra.clear();
+		for (auto &column : extraColumns) {
+			if (column.first < cells.size() && !cells[column.first].empty()) {
+				extra.push_back(make_pair(column.second, attributeValues().intern(cells[column.first])));
+			}
+		}
+		data.extra = extraRows().add(extra);
 		dataset.push_back(data);
 	}
 	file.close();
 	return dataset;
 }
 
+// read the first `columns` numbers of every row (after the header) into one flat array
+vector<double> readNumberCSV(const string &filePath, int columns) {
+	ifstream file(filePath.c_str());
+	vector<double> values;
+	if (!file.is_open()) {
+		cout << "Failed to read files\n";
+		return values;
+	}
+	string tmp;
+	getline(file, tmp); // skip header
+	while (getline(file, tmp)) {
+		vector<double> row;
+		stringstream line(tmp);
+		string cell;
+		while ((int) row.size() < columns && getline(line, cell, ',')) {
+			row.push_back(atof(cell.c_str()));
+		}
+		if ((int) row.size() == columns) {
+			values.insert(values.end(), row.begin(), row.end());
+		}
+	}
+	file.close();
+	return values;
+}
+
+// the header of the CSV files written below, then one row per city; extra columns follow the known ones
+void writeCSVHeader(ostream &file, const vector<string> &extraNames) {
+	file << "city,lat,lng,country,population";
+	for (auto &name : extraNames) {
+		file << "," << csvField(name);
+	}
+	file << "\n";
+}
+
+void writeCSVHeader(ostream &file) {
+	writeCSVHeader(file, extraRows().names);
+}
+
+void writeCSVRow(ostream &file, const Data &data) {
+	file << csvField(cityNames().name(data.city)) << "," << data.latitude << "," << data.longitude << ","
+	     << csvField(countryNames().name(data.country)) << "," << data.population;
+	for (uint32_t c = 0; c < extraRows().names.size(); ++c) {
+		file << "," << csvField(attributeValues().name(extraRows().value(data.extra, c)));
+	}
+	file << "\n";
+}
+
 bool writeCSVFile(const vector<Data> &dataset, const string &filePath) {
 	ofstream file(filePath.c_str());
 	if (!file.is_open()) {
 		return false;
 	}
-	file << "city,lat,lng\n";
+	writeCSVHeader(file);
 	for (auto &data : dataset) {
-		file << data.city << "," << data.latitude << "," << data.longitude << "\n";
+		writeCSVRow(file, data);
 	}
 	file.close();
 	return true;
@@ -215,12 +628,12 @@ bool writeCSVFromTree(KDTree *root, const string &filePath) {
 	return writeCSVFile(dataset, filePath);
 }
 
-KDTree* readCSVFileIntoTree(const string &filePath) {
+KDTree* readCSVFileIntoTree(KDTreeArena &arena, const string &filePath, TaskPool *pool = nullptr) {
 	vector<Data> dataset = readCSVFile(filePath);
 	if (dataset.empty()) {
 		return nullptr;
 	}
-	return buildKDTree(dataset, 0, dataset.size() - 1);
+	return buildKDTree(arena, dataset, 0, dataset.size() - 1, 0, pool);
 }
 
 #include "json.hpp"
@@ -228,20 +641,33 @@ KDTree* readCSVFileIntoTree(const string &filePath) {
 
 // convert tree to json structure
 nlohmann::json tree_to_json(KDTree *root) {
-	if (root == nullptr) {
-		return nullptr;
+	nlohmann::json result = nullptr;
+	// (node, the json value it becomes); values inside an object keep their address as keys are added
+	SmallStack<pair<KDTree *, nlohmann::json *>, TREE_STACK_DEPTH> stack;
+	if (root != nullptr) {
+		stack.push(make_pair(root, &result));
 	}
-
-	nlohmann::json j;
-	j["data"] = nlohmann::json{
-		{"city",      root->data.city},
-		{"latitude",  root->data.latitude},
-		{"longitude", root->data.longitude}
-	};
-	j["left"] = tree_to_json(root->left);
-	j["right"] = tree_to_json(root->right);
-
-	return j;
+	while (!stack.empty()) {
+		pair<KDTree *, nlohmann::json *> top = stack.pop();
+		KDTree *node = top.first;
+		nlohmann::json &j = *top.second;
+		j["data"] = nlohmann::json{
+			{"city",       cityNames().name(node->data.city)},
+			{"latitude",   node->data.latitude},
+			{"longitude",  node->data.longitude},
+			{"country",    countryNames().name(node->data.country)},
+			{"population", node->data.population}
+		};
+		const ExtraRows &rows = extraRows();
+		for (uint32_t k = rows.start[node->data.extra]; k < rows.start[node->data.extra + 1]; ++k) {
+			j["data"]["extra"][rows.names[rows.cells[k].first]] = attributeValues().name(rows.cells[k].second);
+		}
+		j["left"] = nullptr;
+		j["right"] = nullptr;
+		if (node->right != nullptr) stack.push(make_pair(node->right, &j["right"]));
+		if (node->left != nullptr) stack.push(make_pair(node->left, &j["left"]));
+	}
+	return result;
 }
 
 // open file, convert tree to json structure then save the structure to the file
@@ -259,43 +685,60 @@ bool saveKDTree(const string &filePath, KDTree *root) {
 	return true;
 }
 
-// convert json's data to node's data
+// convert json's data to node's data, the attributes are optional
 Data data_from_json(const nlohmann::json &j) {
+	vector<pair<uint32_t, uint32_t> > extra;
+	if (j.contains("extra")) {
+		for (auto &cell : j.at("extra").items()) {
+			uint32_t value = attributeValues().intern(cell.value().get<std::string>());
+			if (value != 0) extra.push_back(make_pair(extraRows().column(cell.key()), value));
+		}
+	}
 	return {
-		j.at("city").get<std::string>(),
+		cityNames().intern(j.at("city").get<std::string>()),
 		j.at("latitude").get<double>(),
-		j.at("longitude").get<double>()
+		j.at("longitude").get<double>(),
+		countryNames().intern(j.value("country", std::string())),
+		j.value("population", 0LL),
+		extraRows().add(extra)
 	};
 }
 
 // convert json's class property to node's property
-KDTree *tree_from_json(const nlohmann::json &j) {
-	if (j.is_null()) {
-		return nullptr;
-	}
-
-	auto *root = new KDTree;
-
-	if (j.contains("data")) {
-		root->data = data_from_json(j.at("data"));
-	}
-
-	if (j.contains("left")) {
-		root->left = tree_from_json(j.at("left"));
-	}
-	if (j.contains("right")) {
-		root->right = tree_from_json(j.at("right"));
+KDTree *tree_from_json(KDTreeArena &arena, const nlohmann::json &j) {
+	KDTree *root = nullptr;
+	// (json value, the link the node made from it goes to), nodes are allocated in the same order as before
+	SmallStack<pair<const nlohmann::json *, KDTree **>, TREE_STACK_DEPTH> stack;
+	stack.push(make_pair(&j, &root));
+	while (!stack.empty()) {
+		pair<const nlohmann::json *, KDTree **> top = stack.pop();
+		const nlohmann::json &value = *top.first;
+		if (value.is_null()) continue;
+
+		KDTree *node = *top.second = arena.allocate(Data());
+
+		if (value.contains("data")) {
+			node->data = data_from_json(value.at("data"));
+		}
+
+		if (value.contains("right")) {
+			stack.push(make_pair(&value.at("right"), &node->right));
+		}
+		if (value.contains("left")) {
+			stack.push(make_pair(&value.at("left"), &node->left));
+		}
 	}
+	computeSizes(root);
 	return root;
 }
 
 // load kdtree from json file
-KDTree *loadKDTree(const string &filePath) {
+KDTree *loadKDTree(KDTreeArena &arena, const string &filePath) {
 	ifstream file(filePath.c_str());
 	if (!file.is_open()) {
 		return nullptr;
 	}
-	KDTree *root = tree_from_json(nlohmann::json::parse(file));
+	KDTree *root = tree_from_json(arena, nlohmann::json::parse(file));
 	file.close();
 	return root;
 }
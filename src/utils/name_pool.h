@@ -0,0 +1,74 @@
+#ifndef KD_TREE_NAME_POOL_H
+#define KD_TREE_NAME_POOL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Interned strings. Every distinct name is stored once, back to back in a single buffer, and is referred
+// to by a 32-bit id everywhere else. Lookups go through an open addressing table of ids that hashes the
+// bytes in the buffer, so the pool keeps no second copy of the names.
+struct NamePool {
+	string chars; // all names back to back
+	vector<uint32_t> offsets = {0}; // name i is chars[offsets[i], offsets[i + 1])
+	vector<uint32_t> slots; // id + 1 of the name hashed to this slot, 0 when empty
+
+	uint32_t size() const { return (uint32_t) offsets.size() - 1; }
+
+	string name(uint32_t id) const {
+		return chars.substr(offsets[id], offsets[id + 1] - offsets[id]);
+	}
+
+	uint32_t intern(const string &text) {
+		if ((size() + 1) * 2 > slots.size()) {
+			rehash(slots.empty() ? 1024 : slots.size() * 2);
+		}
+		size_t slot = findSlot(text.data(), text.size());
+		if (slots[slot] == 0) {
+			chars += text;
+			offsets.push_back((uint32_t) chars.size());
+			slots[slot] = size();
+		}
+		return slots[slot] - 1;
+	}
+
+private:
+	static uint64_t hashBytes(const char *text, size_t length) { // FNV-1a
+		uint64_t h = 1469598103934665603ULL;
+		for (size_t i = 0; i < length; ++i) {
+			h = (h ^ (unsigned char) text[i]) * 1099511628211ULL;
+		}
+		return h;
+	}
+
+	bool equals(uint32_t id, const char *text, size_t length) const {
+		return offsets[id + 1] - offsets[id] == length && chars.compare(offsets[id], length, text, length) == 0;
+	}
+
+	// slot holding the name, or the empty slot where it would go (the table size is a power of two)
+	size_t findSlot(const char *text, size_t length) const {
+		size_t mask = slots.size() - 1;
+		size_t slot = hashBytes(text, length) & mask;
+		while (slots[slot] != 0 && !equals(slots[slot] - 1, text, length)) {
+			slot = (slot + 1) & mask;
+		}
+		return slot;
+	}
+
+	void rehash(size_t capacity) {
+		slots.assign(capacity, 0);
+		for (uint32_t id = 0; id < size(); ++id) {
+			slots[findSlot(chars.data() + offsets[id], offsets[id + 1] - offsets[id])] = id + 1;
+		}
+	}
+};
+
+// the pool every city name of the program is interned into
+NamePool &cityNames() {
+	static NamePool pool;
+	return pool;
+}
+
+#endif //KD_TREE_NAME_POOL_H
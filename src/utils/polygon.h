@@ -0,0 +1,169 @@
+#ifndef KD_TREE_POLYGON_H
+#define KD_TREE_POLYGON_H
+
+#include <vector>
+
+#include "flat_kdtree.h"
+
+using namespace std;
+
+// A polygon (geofence) given by its vertices in (latitude, longitude) degrees, the last one connecting back to
+// the first. Edges are straight lines in that plane and do not wrap around the antimeridian. A point is inside
+// by the even-odd rule, so holes (as extra rings joined by a bridge) and self-intersections work as expected.
+// Point tests only look at the edges of one latitude band, so they stay cheap for polygons with thousands of
+// vertices.
+struct GeoPolygon {
+	vector<double> lat, lng;
+	double lo[2], hi[2]; // bounding box
+	double bandHeight = 1;
+	vector<int> bandStart; // the edges crossing band b are bandEdges[bandStart[b] .. bandStart[b + 1])
+	vector<int> bandEdges;
+
+	GeoPolygon() {}
+
+	// vertices as latLng[2 * i], latLng[2 * i + 1]
+	explicit GeoPolygon(const vector<double> &latLng) {
+		for (size_t i = 0; i + 1 < latLng.size(); i += 2) {
+			lat.push_back(latLng[i]);
+			lng.push_back(latLng[i + 1]);
+		}
+		buildBands();
+	}
+
+	int edges() const { return (int) lat.size(); }
+
+	// edge e goes from vertex e to vertex e + 1 (mod the number of vertices)
+	int next(int e) const { return e + 1 == edges() ? 0 : e + 1; }
+
+	bool contains(double pointLat, double pointLng) const {
+		if (edges() < 3 || pointLat < lo[0] || pointLat > hi[0] || pointLng < lo[1] || pointLng > hi[1]) return false;
+		bool inside = false;
+		int band = bandOf(pointLat);
+		for (int k = bandStart[band]; k < bandStart[band + 1]; ++k) {
+			int a = bandEdges[k], b = next(a);
+			if ((lat[a] > pointLat) != (lat[b] > pointLat) &&
+			    pointLng < lng[a] + (pointLat - lat[a]) * (lng[b] - lng[a]) / (lat[b] - lat[a])) {
+				inside = !inside;
+			}
+		}
+		return inside;
+	}
+
+	// whether edge e has a point in the box [boxLo, boxHi]: the boxes overlap and the box's corners are not
+	// all strictly on one side of the edge's line
+	bool edgeTouchesBox(int e, const double *boxLo, const double *boxHi) const {
+		int f = next(e);
+		if (max(lat[e], lat[f]) < boxLo[0] || min(lat[e], lat[f]) > boxHi[0] ||
+		    max(lng[e], lng[f]) < boxLo[1] || min(lng[e], lng[f]) > boxHi[1]) {
+			return false;
+		}
+		double dLat = lat[f] - lat[e], dLng = lng[f] - lng[e];
+		int above = 0, below = 0;
+		for (int corner = 0; corner < 4; ++corner) {
+			double cLat = corner & 1 ? boxHi[0] : boxLo[0], cLng = corner & 2 ? boxHi[1] : boxLo[1];
+			double side = dLat * (cLng - lng[e]) - dLng * (cLat - lat[e]);
+			above += side > 0;
+			below += side < 0;
+		}
+		return above < 4 && below < 4;
+	}
+
+private:
+	int bandOf(double pointLat) const {
+		int band = (int) ((pointLat - lo[0]) / bandHeight);
+		return max(0, min(band, (int) bandStart.size() - 2));
+	}
+
+	// one band per vertex over the latitude range, each listing the edges that overlap it
+	void buildBands() {
+		if (lat.empty()) return;
+		lo[0] = *min_element(lat.begin(), lat.end());
+		hi[0] = *max_element(lat.begin(), lat.end());
+		lo[1] = *min_element(lng.begin(), lng.end());
+		hi[1] = *max_element(lng.begin(), lng.end());
+		int bands = edges();
+		bandHeight = hi[0] > lo[0] ? (hi[0] - lo[0]) / bands : 1;
+		bandStart.assign(bands + 1, 0);
+		bandEdges.clear();
+		for (int pass = 0; pass < 2; ++pass) { // count, then fill
+			vector<int> fill(bandStart.begin(), bandStart.end() - 1);
+			for (int e = 0; e < edges(); ++e) {
+				int from = bandOf(min(lat[e], lat[next(e)])), to = bandOf(max(lat[e], lat[next(e)]));
+				for (int band = from; band <= to; ++band) {
+					if (pass == 0) {
+						bandStart[band + 1]++;
+					} else {
+						bandEdges[fill[band]++] = e;
+					}
+				}
+			}
+			if (pass == 0) {
+				for (int band = 0; band < bands; ++band) {
+					bandStart[band + 1] += bandStart[band];
+				}
+				bandEdges.resize(bandStart[bands]);
+			}
+		}
+	}
+};
+
+// Call visit(i) with the index of every point of the tree inside the polygon until it returns false; returns
+// false if that happened. Every subtree carries the edges that touch its bounding box, narrowed down from its
+// parent's, so each level only looks at the edges near it. A subtree that no edge touches lies entirely inside
+// or outside, which a single point test decides: inside, all its points are handed over without looking at
+// them, outside, it is skipped. Points are tested one by one only in subtrees the boundary runs through.
+template <typename Visitor>
+bool visitPolygon(const FlatKDTree &tree, const GeoPolygon &polygon, Visitor visit) {
+	struct Frame {
+		long long l, r;
+		size_t edgesFrom, edgesTo; // the edges touching the parent's box, a slice of edges below
+	};
+	if (tree.empty() || polygon.edges() < 3) return true;
+	vector<int> edges(polygon.edges()); // the edge lists of the frames on the stack, one after the other
+	for (int e = 0; e < polygon.edges(); ++e) {
+		edges[e] = e;
+	}
+	Frame stack[FLAT_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = {0, tree.size() - 1, 0, edges.size()};
+	while (top > 0) {
+		Frame frame = stack[--top];
+		if (frame.r < frame.l) continue;
+		edges.resize(frame.edgesTo); // drop the lists of the subtrees walked since this frame was pushed
+		long long m = (frame.l + frame.r) / 2;
+		double lo[2] = {tree.boxLo[0][m], tree.boxLo[1][m]}, hi[2] = {tree.boxHi[0][m], tree.boxHi[1][m]};
+		if (lo[0] > polygon.hi[0] || hi[0] < polygon.lo[0] || lo[1] > polygon.hi[1] || hi[1] < polygon.lo[1]) continue;
+
+		size_t from = edges.size();
+		for (size_t k = frame.edgesFrom; k < frame.edgesTo; ++k) {
+			if (polygon.edgeTouchesBox(edges[k], lo, hi)) edges.push_back(edges[k]);
+		}
+		if (edges.size() == from) { // entirely inside or entirely outside
+			if (!polygon.contains((lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2)) continue;
+			for (long long i = frame.l; i <= frame.r; ++i) {
+				if (!visit(i)) return false;
+			}
+			continue;
+		}
+		if (frame.r - frame.l + 1 <= tree.leafSize) { // leaf bucket the boundary runs through
+			for (long long i = frame.l; i <= frame.r; ++i) {
+				if (polygon.contains(tree.coord[0][i], tree.coord[1][i]) && !visit(i)) return false;
+			}
+			continue;
+		}
+		if (polygon.contains(tree.coord[0][m], tree.coord[1][m]) && !visit(m)) return false;
+		stack[top++] = {m + 1, frame.r, from, edges.size()};
+		stack[top++] = {frame.l, m - 1, from, edges.size()};
+	}
+	return true;
+}
+
+// collect indices of the points inside the polygon
+void polygonQuery(const FlatKDTree &tree, const GeoPolygon &polygon, vector<long long> &result) {
+	visitPolygon(tree, polygon, [&result](long long i) {
+		result.push_back(i);
+		return true;
+	});
+}
+
+#endif //KD_TREE_POLYGON_H
@@ -0,0 +1,116 @@
+#ifndef KD_TREE_QUERY_EXECUTOR_H
+#define KD_TREE_QUERY_EXECUTOR_H
+
+#include <vector>
+
+#include "flat_kdtree.h"
+#include "task_pool.h"
+
+using namespace std;
+
+// Runs batches of queries against one immutable tree on a TaskPool. A batch is cut into slices of
+// QUERY_SLICE queries; every slice is one task that writes only to its own part of the output, and
+// temporary buffers come from a scratch slot owned by the thread running the task, so the threads
+// share nothing mutable and throughput grows with the number of cores.
+const long long QUERY_SLICE = 2048;
+
+template <typename Coord, int Dim, typename Metric>
+class QueryExecutor {
+public:
+	typedef BasicFlatKDTree<Coord, Dim, Metric> Tree;
+
+	QueryExecutor(const Tree &tree, TaskPool &pool) : tree(tree), pool(pool), scratch(pool.size() + 1) {}
+
+	// nearest neighbor of each target, in Morton order within the whole batch (see nearestBatch); the work
+	// done by the whole batch is added to stats when given
+	void nearest(const Coord *targets, long long n, long long *index, double *dist,
+	             const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr) {
+		vector<pair<uint64_t, long long> > schedule = mortonSchedule(tree, targets, n);
+		forEachSlice(n, [&](long long, long long from, long long to) {
+			nearestScheduled(tree, targets, schedule.data() + from, to - from, index, dist, options, &scratch[slot()].stats);
+		});
+		collectStats(stats);
+	}
+
+	// the k nearest points of targets[i] the filter passes go to out[i * k ..], found[i] tells how many there are
+	template <typename Filter = AcceptAll>
+	void kNearest(const Coord *targets, long long n, int k, Neighbor *out, int *found,
+	              const SearchOptions &options = SearchOptions(), SearchStats *stats = nullptr, const Filter &filter = Filter()) {
+		forEachSlice(n, [&](long long, long long from, long long to) {
+			SearchStats &local = scratch[slot()].stats;
+			for (long long i = from; i < to; ++i) {
+				found[i] = ::kNearest(tree, targets + i * Dim, k, out + i * k, options, &local, filter);
+			}
+		});
+		collectStats(stats);
+	}
+
+	// points inside the boxes [lo, hi] (Dim coordinates each), at most limit per box when limit > 0; the hits of
+	// box i are hits[offsets[i] .. offsets[i + 1])
+	void range(const Coord *lo, const Coord *hi, long long n, vector<long long> &offsets, vector<long long> &hits, long long limit = 0) {
+		long long slices = (n + QUERY_SLICE - 1) / QUERY_SLICE;
+		vector<vector<long long> > sliceHits(slices);
+		offsets.assign(n + 1, 0);
+		forEachSlice(n, [&](long long slice, long long from, long long to) {
+			vector<long long> &buffer = scratch[slot()].hits;
+			for (long long i = from; i < to; ++i) {
+				buffer.clear();
+				flatRangeQuery(tree, buffer, lo + i * Dim, hi + i * Dim, limit);
+				offsets[i + 1] = (long long) buffer.size();
+				sliceHits[slice].insert(sliceHits[slice].end(), buffer.begin(), buffer.end());
+			}
+		});
+		for (long long i = 0; i < n; ++i) {
+			offsets[i + 1] += offsets[i];
+		}
+		hits.clear();
+		hits.reserve(offsets[n]);
+		for (auto &slice : sliceHits) {
+			hits.insert(hits.end(), slice.begin(), slice.end());
+		}
+	}
+
+	// number of points inside each of the boxes [lo, hi]
+	void count(const Coord *lo, const Coord *hi, long long n, long long *counts) {
+		forEachSlice(n, [&](long long, long long from, long long to) {
+			for (long long i = from; i < to; ++i) {
+				counts[i] = rangeCount(tree, lo + i * Dim, hi + i * Dim);
+			}
+		});
+	}
+
+private:
+	struct Scratch {
+		vector<long long> hits;
+		SearchStats stats;
+	};
+
+	const Tree &tree;
+	TaskPool &pool;
+	vector<Scratch> scratch; // one per worker, the last one for the thread that submits the batch
+
+	size_t slot() const {
+		int worker = pool.currentWorker();
+		return worker < 0 ? scratch.size() - 1 : (size_t) worker;
+	}
+
+	// move what the workers counted during the last batch into stats
+	void collectStats(SearchStats *stats) {
+		for (auto &slotScratch : scratch) {
+			if (stats != nullptr) stats->add(slotScratch.stats);
+			slotScratch.stats = SearchStats();
+		}
+	}
+
+	// body(slice, from, to) for every slice of [0, n), run as tasks of the pool
+	void forEachSlice(long long n, const function<void(long long, long long, long long)> &body) {
+		TaskGroup group;
+		for (long long from = 0, slice = 0; from < n; from += QUERY_SLICE, ++slice) {
+			long long to = min(n, from + QUERY_SLICE);
+			pool.submit(group, [&body, slice, from, to]() { body(slice, from, to); });
+		}
+		pool.wait(group);
+	}
+};
+
+#endif //KD_TREE_QUERY_EXECUTOR_H
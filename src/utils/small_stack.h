@@ -0,0 +1,40 @@
+#ifndef KD_TREE_SMALL_STACK_H
+#define KD_TREE_SMALL_STACK_H
+
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+// LIFO stack for walking trees without recursion. The first N entries live in an array inside the stack
+// object itself, so on the caller's stack frame; only a walk deeper than that, which the unbalanced trees
+// insertData() builds can need, spills the rest to the heap.
+template <typename T, size_t N>
+class SmallStack {
+public:
+	bool empty() const { return count == 0; }
+
+	void push(const T &value) {
+		if (count < N) {
+			items[count] = value;
+		} else {
+			spill.push_back(value);
+		}
+		++count;
+	}
+
+	T pop() {
+		--count;
+		if (count < N) return items[count];
+		T value = spill.back();
+		spill.pop_back();
+		return value;
+	}
+
+private:
+	T items[N];
+	vector<T> spill; // entries N and up
+	size_t count = 0;
+};
+
+#endif //KD_TREE_SMALL_STACK_H
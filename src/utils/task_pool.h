@@ -0,0 +1,172 @@
+#ifndef KD_TREE_TASK_POOL_H
+#define KD_TREE_TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Counts the tasks of one batch that have not finished yet
+struct TaskGroup {
+	atomic<long long> pending;
+
+	TaskGroup() : pending(0) {}
+};
+
+// rounds a waiting thread yields while there is nothing to run before it sleeps until the group is done
+const int TASK_WAIT_SPINS = 64;
+
+unsigned defaultThreadCount() {
+	unsigned n = thread::hardware_concurrency();
+	return n == 0 ? 1 : n;
+}
+
+// Work-stealing thread pool. Every worker owns a deque of tasks: it pushes and pops at the back of its own
+// deque (newest first, which keeps recursive work cache-local) and steals from the front of the others'
+// (oldest first, which hands out the biggest pieces of a recursion). Tasks submitted from outside the pool
+// go to a shared deque that everyone steals from. A thread waiting on a group runs queued tasks meanwhile,
+// so nested waits cannot deadlock and a pool with no workers still makes progress on the caller thread.
+class TaskPool {
+public:
+	explicit TaskPool(unsigned threads = defaultThreadCount()) : queues(threads + 1), queued(0), stopping(false) {
+		for (auto &queue : queues) {
+			queue.reset(new TaskQueue);
+		}
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back(&TaskPool::workerLoop, this, (int) i);
+		}
+	}
+
+	TaskPool(const TaskPool &) = delete;
+	TaskPool &operator=(const TaskPool &) = delete;
+
+	~TaskPool() {
+		{
+			lock_guard<mutex> lock(sleepLock);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	// number of worker threads (the thread calling wait() comes on top of these)
+	unsigned size() const { return (unsigned) workers.size(); }
+
+	// index of the calling worker thread in this pool, -1 for any other thread
+	int currentWorker() const {
+		return currentPool() == this ? currentIndex() : -1;
+	}
+
+	void submit(TaskGroup &group, function<void()> task) {
+		group.pending.fetch_add(1);
+		int self = currentWorker();
+		TaskQueue &queue = *queues[self < 0 ? workers.size() : (size_t) self];
+		{
+			lock_guard<mutex> lock(queue.lock);
+			queue.tasks.emplace_back([this, &group, task]() {
+				task();
+				if (group.pending.fetch_sub(1) == 1) {
+					lock_guard<mutex> lock(sleepLock); // a thread between its check in wait() and its sleep must not miss this
+					wakeUp.notify_all();
+				}
+			});
+		}
+		queued.fetch_add(1);
+		{
+			lock_guard<mutex> lock(sleepLock); // a worker between its check and its sleep must not miss this
+		}
+		wakeUp.notify_one();
+	}
+
+	// Block until every task of the group is done, running pending tasks in the meantime. When there has been
+	// nothing to run for a while, sleep until the group is done or new tasks arrive.
+	void wait(TaskGroup &group) {
+		int self = currentWorker();
+		int idle = 0;
+		while (group.pending.load() > 0) {
+			if (runOne(self)) {
+				idle = 0;
+			} else if (++idle < TASK_WAIT_SPINS) {
+				this_thread::yield();
+			} else {
+				unique_lock<mutex> lock(sleepLock);
+				wakeUp.wait(lock, [this, &group]() { return group.pending.load() == 0 || queued.load() > 0; });
+				idle = 0;
+			}
+		}
+	}
+
+private:
+	struct TaskQueue {
+		mutex lock;
+		deque<function<void()>> tasks;
+	};
+
+	vector<unique_ptr<TaskQueue>> queues; // one per worker, the last one is shared by outside threads
+	vector<thread> workers;
+	atomic<long long> queued;
+	mutex sleepLock;
+	condition_variable wakeUp;
+	bool stopping;
+
+	static const TaskPool *&currentPool() {
+		static thread_local const TaskPool *pool = nullptr;
+		return pool;
+	}
+
+	static int &currentIndex() {
+		static thread_local int index = -1;
+		return index;
+	}
+
+	bool takeBack(TaskQueue &queue, function<void()> &task) {
+		lock_guard<mutex> lock(queue.lock);
+		if (queue.tasks.empty()) return false;
+		task = move(queue.tasks.back());
+		queue.tasks.pop_back();
+		return true;
+	}
+
+	bool takeFront(TaskQueue &queue, function<void()> &task) {
+		lock_guard<mutex> lock(queue.lock);
+		if (queue.tasks.empty()) return false;
+		task = move(queue.tasks.front());
+		queue.tasks.pop_front();
+		return true;
+	}
+
+	// run one task: our own newest one first, otherwise steal the oldest task of another queue
+	bool runOne(int self) {
+		if (queued.load() == 0) return false;
+		function<void()> task;
+		bool found = self >= 0 && takeBack(*queues[self], task);
+		for (size_t k = 1; !found && k <= queues.size(); ++k) {
+			found = takeFront(*queues[(self + k) % queues.size()], task);
+		}
+		if (!found) return false;
+		queued.fetch_sub(1);
+		task();
+		return true;
+	}
+
+	void workerLoop(int index) {
+		currentPool() = this;
+		currentIndex() = index;
+		while (true) {
+			if (runOne(index)) continue;
+			unique_lock<mutex> lock(sleepLock);
+			wakeUp.wait(lock, [this]() { return stopping || queued.load() > 0; });
+			if (stopping && queued.load() == 0) return;
+		}
+	}
+};
+
+#endif //KD_TREE_TASK_POOL_H